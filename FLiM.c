@@ -80,6 +80,39 @@ rom EventTableEntry     *EVTPtr;    // Event table in ROM
 #pragma udata
 #endif
 
+/*
+ * Opcode classification table, generated at compile time from the opcode definitions
+ * in cbusdefs8m.h. Used by parseCBUSMsg so that frames which are not events do not
+ * pay for an event lookup, and frames the library does not handle are dropped at once.
+ */
+#define OPC_IS_NODE_CMD(o)      ((o)==OPC_NNLRN || (o)==OPC_NNULN || (o)==OPC_NNCLR || (o)==OPC_EVULN || \
+                                 (o)==OPC_EVLRN || (o)==OPC_EVLRNI || (o)==OPC_REQEV || (o)==OPC_BOOT || \
+                                 (o)==OPC_RQNPN || (o)==OPC_NNEVN || (o)==OPC_NERD || (o)==OPC_RQEVN || \
+                                 (o)==OPC_NVRD || (o)==OPC_NVSET || (o)==OPC_REVAL)
+#define OPC_IS_BROADCAST_CMD(o) ((o)==OPC_QNN || (o)==OPC_RQNP || (o)==OPC_RQMN || (o)==OPC_SNN)
+#ifdef EVENT_STATE_CACHE
+#define OPC_IS_EVENT_REQUEST(o) ((o)==OPC_AREQ || (o)==OPC_ASRQ)
+#else
+#define OPC_IS_EVENT_REQUEST(o) FALSE
+#endif
+
+#define OPC_CLASS(o)            ((IS_EVENT_OPC(o) || IS_RESPONSE_EVENT_OPC(o)) ? OPC_CLASS_EVENT : \
+                                 OPC_IS_EVENT_REQUEST(o) ? OPC_CLASS_EVENT_REQUEST : \
+                                 OPC_IS_NODE_CMD(o) ? OPC_CLASS_NODE : \
+                                 OPC_IS_BROADCAST_CMD(o) ? OPC_CLASS_BROADCAST : OPC_CLASS_NONE)
+
+#define OPC_CLASS_ROW(r)        OPC_CLASS(r+0x0), OPC_CLASS(r+0x1), OPC_CLASS(r+0x2), OPC_CLASS(r+0x3), \
+                                OPC_CLASS(r+0x4), OPC_CLASS(r+0x5), OPC_CLASS(r+0x6), OPC_CLASS(r+0x7), \
+                                OPC_CLASS(r+0x8), OPC_CLASS(r+0x9), OPC_CLASS(r+0xA), OPC_CLASS(r+0xB), \
+                                OPC_CLASS(r+0xC), OPC_CLASS(r+0xD), OPC_CLASS(r+0xE), OPC_CLASS(r+0xF)
+
+const BYTE opcodeClass[256] = {
+    OPC_CLASS_ROW(0x00), OPC_CLASS_ROW(0x10), OPC_CLASS_ROW(0x20), OPC_CLASS_ROW(0x30),
+    OPC_CLASS_ROW(0x40), OPC_CLASS_ROW(0x50), OPC_CLASS_ROW(0x60), OPC_CLASS_ROW(0x70),
+    OPC_CLASS_ROW(0x80), OPC_CLASS_ROW(0x90), OPC_CLASS_ROW(0xA0), OPC_CLASS_ROW(0xB0),
+    OPC_CLASS_ROW(0xC0), OPC_CLASS_ROW(0xD0), OPC_CLASS_ROW(0xE0), OPC_CLASS_ROW(0xF0)
+};
+
 BOOL	FLiMFlash;              // LED is flashing
 BOOL	FlashStatus;			// Control flash on/off of LED during FLiM setup etc
 BOOL    NV_changed;
@@ -237,10 +270,29 @@ void SLiMRevert(void) {
  * @return true if the message was processed
  */
 BOOL parseCBUSMsg(BYTE *msg) {
-    // Process the incoming message
-    if (!parseCbusEvent(msg))
-        return( parseFLiMCmd(msg));
-    return FALSE;
+#ifdef FLASH_DEFERRED_FLUSH
+    // sync point, the configuration commands read and rewrite the event tables and NVs
+    // straight from Flash. Only those parseFLiMCmd acts on need it, the ones in learn
+    // mode, which may carry an event's NN, and those addressed to this node. Events are
+    // looked up through the Flash image so don't need it.
+    if ((opcodeClass[msg[d0]] == OPC_CLASS_NODE) && ((flimState == fsFLiMLearn) || thisNN(msg))) {
+        flushFlashImage();
+    }
+#endif
+    // Process the incoming message according to the class of its opcode
+    switch (opcodeClass[msg[d0]]) {
+        case OPC_CLASS_EVENT:
+            return parseCbusEvent(msg);
+#ifdef EVENT_STATE_CACHE
+        case OPC_CLASS_EVENT_REQUEST:
+            return parseCbusEventRequest(msg);
+#endif
+        case OPC_CLASS_NODE:
+        case OPC_CLASS_BROADCAST:
+            return parseFLiMCmd(msg);
+        default:
+            return FALSE;
+    }
 }
 
 
@@ -271,10 +323,11 @@ BOOL parseFLiMCmd(BYTE *rx_ptr) {
         case OPC_NNULN:
             // Release node from learn mode
              flimState = fsFLiM;
+             eventsEndLearn();
             break;
         case OPC_NNCLR:
             // Clear all events
-            doNnclr;
+            doNnclr();
             break;
         case OPC_EVULN:
             // Unlearn event
@@ -482,7 +535,8 @@ void doNvset(BYTE NVindex, BYTE NVvalue)
 
         BYTE oldValue = *NVPtr[--NVindex];
         if (validateNV(NVindex, oldValue, NVvalue)) {
-            writeFlashByte((BYTE *)flashIndex, NVvalue);
+            writeFlashImage((BYTE *)flashIndex, NVvalue);
+            commitFlashImage();
             actUponNVchange(NVindex, NVvalue);
             cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
         } else {
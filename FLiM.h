@@ -248,6 +248,14 @@ void requestNodeNumber( void );
 
 void	SLiMRevert(void);
 
+// Opcode classes used by parseCBUSMsg to route each incoming frame
+
+#define OPC_CLASS_NONE          0   // Not processed by the library
+#define OPC_CLASS_EVENT         1   // Event, to be looked up in the consumed events table
+#define OPC_CLASS_NODE          2   // Configuration command addressed to a node, or a learn mode command
+#define OPC_CLASS_BROADCAST     3   // Command not addressed to any particular node
+#define OPC_CLASS_EVENT_REQUEST 4   // Request for the state of an event, see EVENT_STATE_CACHE
+
 // parse incoming message for events or commands
 
 BOOL parseCBUSMsg(BYTE *msg);
@@ -0,0 +1,558 @@
+/*
+ Host benchmark of the event hash functions - part of CBUS libraries for PIC 18F
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+
+ This is not part of the firmware and must not be added to the MPLAB-X project.
+ Build and run it on the host with:
+
+     gcc -O2 -o hash_bench bench/hash_bench.c && ./hash_bench
+
+ It fills a hashtable the way addHashtableEntry() in events.c does, with Robin Hood
+ linear probing, for several layouts of node and event numbers and reports for each
+ of the EVENT_HASH_FUNCTION choices:
+   max    the longest probe sequence, eventHashMaxProbe + 1
+   hit    the mean number of event compares to find a consumed event
+   miss   the mean number of hashtable entries read to reject an event which is not
+          consumed, the lookup stopping at an unused entry or after max probes
+ The original eventChains[32][20] layout is shown for comparison, where a lookup
+ compares each event in the chain.
+ With the default 256 entries the EVENT_SORTED_TABLE binary search is shown too. Its
+ hit and miss columns are the number of events it reads from Flash, and for all the
+ lookups reads is the mean number of words read from eventKeys in Flash per lookup,
+ found or not, the main cost on the PIC as each read is a table read.
+ Lastly the EVENT_PERFECT_HASH build is run as buildPerfectHash() does for each layout
+ and for 1000 random layouts, counting the seeds tried and the events hashed, which
+ is most of the build time as each one reads the event from Flash.
+*/
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned short WORD;
+typedef unsigned char BYTE;
+
+#define NO_INDEX        0xFF
+#define MAX_EVENTS      192         // NUM_CONSUMED_EVENTS
+#define OLD_HASH_LENGTH 32
+#define OLD_CHAIN_LENGTH 20
+#define NUM_MISSES      4000        // events looked up which are not consumed
+
+#define EVENT_HASH_BUCKETS      64      // as in events.c
+#define EVENT_HASH_SLOTS        256
+#define EVENT_HASH_MAX_BUCKET   8
+#define EVENT_HASH_SEEDS        16
+#define PERFECT_HASH_BUCKET(h)  ((BYTE)((h) >> 8) & (EVENT_HASH_BUCKETS - 1))
+#define PERFECT_HASH_SLOT(h)    ((h) & (EVENT_HASH_SLOTS - 1))
+#define PERFECT_HASH_WRAP(s)    ((s) & (EVENT_HASH_SLOTS - 1))
+#define NUM_RANDOM_BUILDS       1000
+
+typedef struct {
+    WORD NN;
+    WORD EN;
+} Event;
+
+static Event events[MAX_EVENTS];
+static int numEvents;
+static unsigned int hashLength;     // EVENT_HASH_LENGTH
+static unsigned int hashBits;       // log2(EVENT_HASH_LENGTH)
+static BYTE pearson[256];           // table for the example module hash
+static long flashReads;             // words read from eventKeys
+
+typedef BYTE (*HashFunction)(WORD nn, WORD en);
+
+/**
+ * EVENT_HASH_XOR, the original hash.
+ */
+static BYTE hashXor(WORD nn, WORD en) {
+    BYTE hash;
+    hash = nn ^ (nn >> 8);
+    hash = 7*hash + (en ^ (en >> 8));
+    return hash & (hashLength - 1);
+}
+
+/**
+ * EVENT_HASH_MULTIPLY as first committed, the top byte of the product masked to the
+ * table length, so the bits below the top ones are used for smaller tables.
+ */
+static BYTE hashMultiplyByte(WORD nn, WORD en) {
+    WORD key = (WORD)(nn * 31) ^ en;
+    BYTE hash = (WORD)(key * 40503u) >> 8;
+    return hash & (hashLength - 1);
+}
+
+/**
+ * EVENT_HASH_MULTIPLY taking the top bits of the product, as many as the table
+ * length needs.
+ */
+static BYTE hashMultiply(WORD nn, WORD en) {
+    WORD key = (WORD)(nn * 31) ^ en;
+    return (WORD)(key * 40503u) >> (16 - hashBits);
+}
+
+/**
+ * An example EVENT_HASH_MODULE hash, a Pearson hash of the four bytes using a
+ * 256 byte permutation table in Flash.
+ */
+static BYTE hashModule(WORD nn, WORD en) {
+    BYTE hash;
+    hash = pearson[nn >> 8];
+    hash = pearson[hash ^ (nn & 0xFF)];
+    hash = pearson[hash ^ (en >> 8)];
+    hash = pearson[hash ^ (en & 0xFF)];
+    return hash & (hashLength - 1);
+}
+
+static const struct {
+    const char * name;
+    HashFunction hash;
+} hashes[] = {
+    {"xor", hashXor},
+    {"multiply/byte", hashMultiplyByte},
+    {"multiply", hashMultiply},
+    {"module", hashModule},
+};
+#define NUM_HASHES  (sizeof(hashes)/sizeof(hashes[0]))
+
+/**
+ * Fill the table with Robin Hood insertion as addHashtableEntry() does.
+ * @return the longest probe sequence, counting the first entry as probe 0
+ */
+static int fillHashtable(BYTE * table, HashFunction hash) {
+    int i, maxProbe = 0;
+    memset(table, NO_INDEX, hashLength);
+    for (i=0; i<numEvents; i++) {
+        BYTE evtIdx = i;
+        BYTE h = hash(events[i].NN, events[i].EN);
+        int probe = 0;
+        BYTE other;
+        while ((other = table[h]) != NO_INDEX) {
+            int otherProbe = (h - hash(events[other].NN, events[other].EN)) & (hashLength - 1);
+            if (otherProbe < probe) {
+                table[h] = evtIdx;
+                if (probe > maxProbe) maxProbe = probe;
+                evtIdx = other;
+                probe = otherProbe;
+            }
+            h = (h + 1) & (hashLength - 1);
+            probe++;
+        }
+        table[h] = evtIdx;
+        if (probe > maxProbe) maxProbe = probe;
+    }
+    return maxProbe;
+}
+
+/**
+ * @return non zero if the event is one of the consumed events
+ */
+static int isConsumed(WORD nn, WORD en) {
+    int i;
+    for (i=0; i<numEvents; i++) {
+        if ((events[i].NN == nn) && (events[i].EN == en)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Make an event which is not consumed, from the same nodes as the consumed events
+ * or from any node, as seen on a busy layout.
+ */
+static Event randomMiss(void) {
+    Event e;
+    do {
+        if (rand() & 1) {
+            e = events[rand() % numEvents];
+            e.EN += 1 + rand() % 8;
+        } else {
+            e.NN = (rand() % 4 == 0) ? 0 : 256 + rand() % 64;
+            e.EN = 1 + rand() % 256;
+        }
+    } while (isConsumed(e.NN, e.EN));
+    return e;
+}
+
+/**
+ * Compare an event with one in eventKeys as the lookups do, EN first.
+ * @return non zero if they are the same
+ */
+static int compareEvent(BYTE evtIdx, WORD nn, WORD en) {
+    flashReads++;
+    if (events[evtIdx].EN != en) return 0;
+    flashReads++;
+    return events[evtIdx].NN == nn;
+}
+
+/**
+ * Look up an event as findEvent() does.
+ * @return the number of hashtable entries read
+ */
+static int lookup(const BYTE * table, HashFunction hash, int maxProbe, WORD nn, WORD en) {
+    BYTE h = hash(nn, en);
+    int probe;
+    for (probe=0; probe<=maxProbe; probe++) {
+        BYTE evtIdx = table[h];
+        if (evtIdx == NO_INDEX) return probe + 1;
+        if (compareEvent(evtIdx, nn, en)) return probe + 1;
+        h = (h + 1) & (hashLength - 1);
+    }
+    return probe;
+}
+
+static void benchHash(const char * name, HashFunction hash) {
+    BYTE table[256];
+    int maxProbe = fillHashtable(table, hash);
+    long hits = 0, misses = 0;
+    int i;
+    flashReads = 0;
+    for (i=0; i<numEvents; i++) {
+        hits += lookup(table, hash, maxProbe, events[i].NN, events[i].EN);
+    }
+    srand(7);
+    for (i=0; i<NUM_MISSES; i++) {
+        Event e = randomMiss();
+        misses += lookup(table, hash, maxProbe, e.NN, e.EN);
+    }
+    printf("    %-14s max %2d  hit %5.2f  miss %5.2f  reads %5.2f\n", name, maxProbe + 1,
+            (double)hits / numEvents, (double)misses / NUM_MISSES,
+            (double)flashReads / (numEvents + NUM_MISSES));
+}
+
+static int compareKeys(const void * a, const void * b) {
+    const Event * x = a;
+    const Event * y = b;
+    if (x->NN != y->NN) return x->NN < y->NN ? -1 : 1;
+    if (x->EN != y->EN) return x->EN < y->EN ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Look up an event with the binary search of the EVENT_SORTED_TABLE findEvent().
+ * The unused slots at the end hold 0xFFFF.
+ * @return the number of events read
+ */
+static int lookupSorted(const Event * keys, WORD nn, WORD en) {
+    int lo = 0, hi = MAX_EVENTS, mid, reads = 0;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        reads++;
+        flashReads++;
+        if (keys[mid].NN == nn) flashReads++;
+        if ((keys[mid].NN < nn) || ((keys[mid].NN == nn) && (keys[mid].EN < en))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < MAX_EVENTS) {
+        reads++;
+        flashReads++;
+        if (keys[lo].EN == en) flashReads++;
+    }
+    return reads;
+}
+
+static void benchSorted(void) {
+    Event keys[MAX_EVENTS];
+    long hits = 0, misses = 0;
+    int i;
+    memset(keys, 0xFF, sizeof(keys));
+    memcpy(keys, events, numEvents * sizeof(Event));
+    qsort(keys, numEvents, sizeof(Event), compareKeys);
+    flashReads = 0;
+    for (i=0; i<numEvents; i++) {
+        hits += lookupSorted(keys, events[i].NN, events[i].EN);
+    }
+    srand(7);
+    for (i=0; i<NUM_MISSES; i++) {
+        Event e = randomMiss();
+        misses += lookupSorted(keys, e.NN, e.EN);
+    }
+    printf("    %-14s         hit %5.2f  miss %5.2f  reads %5.2f\n", "sorted table",
+            (double)hits / numEvents, (double)misses / NUM_MISSES,
+            (double)flashReads / (numEvents + NUM_MISSES));
+}
+
+/**
+ * The original layout, chained in a fixed size array and looked up by comparing
+ * every event in the chain.
+ */
+static BYTE oldHash(WORD nn, WORD en) {
+    BYTE hash = nn ^ (nn >> 8);
+    hash = 7*hash + (en ^ (en >> 8));
+    return hash % OLD_HASH_LENGTH;
+}
+
+static int lookupChain(BYTE chains[][OLD_CHAIN_LENGTH], const int * chainLength, WORD nn, WORD en) {
+    BYTE hash = oldHash(nn, en);
+    int i;
+    for (i=0; i<chainLength[hash]; i++) {
+        if (compareEvent(chains[hash][i], nn, en)) return i + 1;
+    }
+    return i;
+}
+
+static void benchChains(void) {
+    BYTE chains[OLD_HASH_LENGTH][OLD_CHAIN_LENGTH];
+    int chainLength[OLD_HASH_LENGTH];
+    int i, maxChain = 0, overflows = 0;
+    long hits = 0, misses = 0;
+    memset(chainLength, 0, sizeof(chainLength));
+    for (i=0; i<numEvents; i++) {
+        BYTE hash = oldHash(events[i].NN, events[i].EN);
+        if (chainLength[hash] == OLD_CHAIN_LENGTH) {
+            overflows++;
+            continue;
+        }
+        chains[hash][chainLength[hash]++] = i;
+        if (chainLength[hash] > maxChain) maxChain = chainLength[hash];
+    }
+    flashReads = 0;
+    for (i=0; i<numEvents; i++) {
+        hits += lookupChain(chains, chainLength, events[i].NN, events[i].EN);
+    }
+    srand(7);
+    for (i=0; i<NUM_MISSES; i++) {
+        Event e = randomMiss();
+        misses += lookupChain(chains, chainLength, e.NN, e.EN);
+    }
+    printf("    %-14s max %2d  hit %5.2f  miss %5.2f  reads %5.2f  (%d events not stored)\n", "old chains",
+            maxChain, (double)hits / numEvents, (double)misses / NUM_MISSES,
+            (double)flashReads / (numEvents + NUM_MISSES), overflows);
+}
+
+static WORD getPerfectHash(WORD nn, WORD en, BYTE seed) {
+    WORD h;
+    h = (nn ^ (((WORD)seed << 8) | seed)) * 0x9E37 + en;
+    h ^= h >> 7;
+    h *= 0x6B43;
+    h ^= h >> 9;
+    return h;
+}
+
+typedef struct {
+    int seed;                       // seed used, EVENT_HASH_SEEDS if the build failed
+    long hashed;                    // events hashed, each a read of the event from Flash
+    long slotTests;                 // slots tested while finding the displacements
+    BYTE displacements[EVENT_HASH_BUCKETS];
+    BYTE slots[EVENT_HASH_SLOTS];
+} PerfectHashBuild;
+
+/**
+ * Build the perfect hash with the same steps as buildPerfectHash().
+ */
+static void buildPerfectHash(PerfectHashBuild * b) {
+    BYTE buckets[EVENT_HASH_BUCKETS];
+    BYTE placed[EVENT_HASH_BUCKETS];
+    BYTE used[EVENT_HASH_SLOTS];
+    BYTE bucketSlots[EVENT_HASH_MAX_BUCKET];
+    int seed, size, bucket, n, i, j, d, ok = 0;
+    WORD h;
+
+    b->hashed = 0;
+    b->slotTests = 0;
+    for (seed=0; seed<EVENT_HASH_SEEDS; seed++) {
+        memset(buckets, 0, sizeof(buckets));
+        memset(placed, 0, sizeof(placed));
+        memset(used, 0, sizeof(used));
+        ok = 1;
+        for (i=0; i<numEvents; i++) {
+            h = getPerfectHash(events[i].NN, events[i].EN, seed);
+            b->hashed++;
+            if (++buckets[PERFECT_HASH_BUCKET(h)] > EVENT_HASH_MAX_BUCKET) ok = 0;
+        }
+        for (size=EVENT_HASH_MAX_BUCKET; ok && (size>0); size--) {
+            for (bucket=0; ok && (bucket<EVENT_HASH_BUCKETS); bucket++) {
+                if ((buckets[bucket] != size) || placed[bucket]) continue;
+                n = 0;
+                // the firmware visits all NUM_CONSUMED_EVENTS slots, the unused ones aren't hashed
+                for (i=0; i<numEvents; i++) {
+                    h = getPerfectHash(events[i].NN, events[i].EN, seed);
+                    b->hashed++;
+                    if (PERFECT_HASH_BUCKET(h) == bucket) {
+                        bucketSlots[n] = PERFECT_HASH_SLOT(h);
+                        for (j=0; j<n; j++) {
+                            if (bucketSlots[j] == bucketSlots[n]) ok = 0;
+                        }
+                        n++;
+                    }
+                }
+                for (d=0; ok && (d<EVENT_HASH_SLOTS); d++) {
+                    for (i=0; i<n; i++) {
+                        b->slotTests++;
+                        if (used[PERFECT_HASH_WRAP(bucketSlots[i] + d)]) break;
+                    }
+                    if (i == n) break;
+                }
+                if (d == EVENT_HASH_SLOTS) ok = 0;
+                if (ok) {
+                    buckets[bucket] = d;
+                    placed[bucket] = 1;
+                    for (i=0; i<n; i++) {
+                        used[PERFECT_HASH_WRAP(bucketSlots[i] + d)] = 1;
+                    }
+                }
+            }
+        }
+        if (ok) break;
+    }
+    b->seed = seed;
+    if ( ! ok) return;
+    // writing the slots hashes every event once more
+    memcpy(b->displacements, buckets, sizeof(buckets));
+    memset(b->slots, NO_INDEX, sizeof(b->slots));
+    for (i=0; i<numEvents; i++) {
+        h = getPerfectHash(events[i].NN, events[i].EN, seed);
+        b->hashed++;
+        b->slots[PERFECT_HASH_WRAP(h + buckets[PERFECT_HASH_BUCKET(h)])] = i;
+    }
+}
+
+/**
+ * Look up an event with the perfect hash, as the EVENT_PERFECT_HASH findEvent() does.
+ */
+static int lookupPerfect(const PerfectHashBuild * b, WORD nn, WORD en) {
+    WORD h = getPerfectHash(nn, en, b->seed);
+    BYTE evtIdx = b->slots[PERFECT_HASH_WRAP(h + b->displacements[PERFECT_HASH_BUCKET(h)])];
+    if (evtIdx == NO_INDEX) return 0;
+    compareEvent(evtIdx, nn, en);
+    return 1;
+}
+
+static void benchPerfectHash(void) {
+    PerfectHashBuild b;
+    long hits = 0, misses = 0;
+    int i;
+    clock_t start = clock();
+    buildPerfectHash(&b);
+    double us = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC;
+    if (b.seed == EVENT_HASH_SEEDS) {
+        printf("    %-14s build failed after %ld events hashed\n", "perfect hash", b.hashed);
+        return;
+    }
+    flashReads = 0;
+    for (i=0; i<numEvents; i++) {
+        hits += lookupPerfect(&b, events[i].NN, events[i].EN);
+    }
+    srand(7);
+    for (i=0; i<NUM_MISSES; i++) {
+        Event e = randomMiss();
+        misses += lookupPerfect(&b, e.NN, e.EN);
+    }
+    printf("    %-14s         hit %5.2f  miss %5.2f  reads %5.2f  (seed %d, %ld events hashed, %ld slot tests, %.0fus on this host)\n",
+            "perfect hash", (double)hits / numEvents, (double)misses / NUM_MISSES,
+            (double)flashReads / (numEvents + NUM_MISSES), b.seed, b.hashed, b.slotTests, us);
+}
+
+static void addEvent(WORD nn, WORD en) {
+    if ((numEvents < MAX_EVENTS) && ! isConsumed(nn, en)) {
+        events[numEvents].NN = nn;
+        events[numEvents].EN = en;
+        numEvents++;
+    }
+}
+
+/**
+ * Fill events[] with a layout of up to count events.
+ */
+static const char * makeLayout(int layout, int count) {
+    int i;
+    numEvents = 0;
+    srand(layout + 1);
+    switch (layout) {
+        case 0:
+            // mostly short events from consecutive device numbers
+            for (i=0; i<count*5/6; i++) addEvent(0, 1 + i);
+            while (numEvents < count) addEvent(256 + rand() % 8, 1 + rand() % 100);
+            return "short events 1.. and a few long";
+        case 1:
+            // a few producers with many consecutive events each
+            for (i=0; numEvents<count; i++) addEvent(256 + (i / 24) * 37, 1 + i % 24);
+            return "8 nodes x 24 long events";
+        case 2:
+            // many small nodes with default FLiM node numbers from 256
+            for (i=0; numEvents<count; i++) addEvent(256 + i / 4, 1 + i % 4);
+            return "FLiM nodes 256.. x 4 events";
+        case 3:
+            // blocks of events as used for turnouts and sensors
+            for (i=0; numEvents<count; i++) {
+                switch ((i / 16) % 3) {
+                    case 0: addEvent(256, 1 + i); break;
+                    case 1: addEvent(257, 1 + i); break;
+                    default: addEvent(0, 0x100 + i); break;
+                }
+            }
+            return "blocks of 16 from 2 nodes and short";
+        default:
+            // scattered over a large layout
+            while (numEvents < count) addEvent(256 + rand() % 200, 1 + rand() % 200);
+            return "random nodes 256..455 events 1..200";
+    }
+}
+
+int main(void) {
+    static const unsigned int lengths[] = {256, 128, 64};
+    unsigned int l, layout, h;
+    int i, j;
+
+    // a fixed permutation for the example module hash
+    for (i=0; i<256; i++) pearson[i] = i;
+    srand(12345);
+    for (i=255; i>0; i--) {
+        BYTE t;
+        j = rand() % (i + 1);
+        t = pearson[i];
+        pearson[i] = pearson[j];
+        pearson[j] = t;
+    }
+
+    for (l=0; l<sizeof(lengths)/sizeof(lengths[0]); l++) {
+        hashLength = lengths[l];
+        for (hashBits=0; (1u << hashBits) < hashLength; hashBits++) ;
+        printf("EVENT_HASH_LENGTH %u with %u events\n", hashLength, hashLength * 3 / 4);
+        for (layout=0; layout<5; layout++) {
+            const char * name = makeLayout(layout, hashLength * 3 / 4);
+            printf("  %s\n", name);
+            for (h=0; h<NUM_HASHES; h++) {
+                benchHash(hashes[h].name, hashes[h].hash);
+            }
+            if (hashLength == 256) {
+                benchChains();
+                benchSorted();
+                benchPerfectHash();
+            }
+        }
+    }
+
+    {
+        PerfectHashBuild b;
+        int failures = 0, seeds[EVENT_HASH_SEEDS];
+        long hashed = 0, maxHashed = 0;
+        memset(seeds, 0, sizeof(seeds));
+        for (i=0; i<NUM_RANDOM_BUILDS; i++) {
+            numEvents = 0;
+            srand(1000 + i);
+            while (numEvents < MAX_EVENTS) {
+                addEvent((rand() % 4 == 0) ? 0 : 256 + rand() % 200, 1 + rand() % 200);
+            }
+            buildPerfectHash(&b);
+            if (b.seed == EVENT_HASH_SEEDS) {
+                failures++;
+            } else {
+                seeds[b.seed]++;
+            }
+            hashed += b.hashed;
+            if (b.hashed > maxHashed) maxHashed = b.hashed;
+        }
+        printf("EVENT_PERFECT_HASH over %d random layouts of %d events\n", NUM_RANDOM_BUILDS, MAX_EVENTS);
+        printf("  failed %d, built with seed 0: %d, 1: %d, 2: %d, 3 or more: %d\n", failures,
+                seeds[0], seeds[1], seeds[2], NUM_RANDOM_BUILDS - failures - seeds[0] - seeds[1] - seeds[2]);
+        printf("  events hashed per build: mean %ld, most %ld\n", hashed / NUM_RANDOM_BUILDS, maxHashed);
+    }
+    return 0;
+}
@@ -67,6 +67,9 @@ CanPacket canRxFifo[CANRX_FIFO_LEN];
 
 BYTE txIndexNextFree;
 BYTE txIndexNextUsed;
+BYTE txBurstStart;          // First software fifo entry reserved by canTXReserve
+BYTE txBurstReserved;       // Number of entries reserved, zero when no burst is open
+BYTE txBurstFilled;         // Number of reserved entries filled so far
 BYTE rxIndexNextFree;
 BYTE rxIndexNextUsed;
 
@@ -114,6 +117,8 @@ void canInit(BYTE busNum, BYTE initCanID) {
   txOflowCount = 0;
   txIndexNextFree = 0;
   txIndexNextUsed = 0;
+  txBurstReserved = 0;
+  txBurstFilled = 0;
   rxIndexNextFree = 0;
   rxIndexNextUsed = 0;
   txFifoUsage = 0;
@@ -333,10 +338,15 @@ BOOL canSend(BYTE *msg, BYTE msgLen)
 
 BOOL canTX( CanPacket *msg )
 {
-  BYTE* ptr;
-  BOOL  fullUp;
-  BYTE hiIndex;
+  canSetHeader( msg );
+  return canTXFrame( msg );
+}
 
+
+// Set the header of a packet for transmission with our can id - DLC must be set to packet length
+
+void canSetHeader( CanPacket *msg )
+{
   msg->buffer[con] = 0;
   msg->buffer[dlc] &= 0x0F;  // Ensure not RTR
   msg->buffer[sidh] = 0b10110000 | ((canID & 0x78) >>3);
@@ -344,7 +354,23 @@ BOOL canTX( CanPacket *msg )
 
   if (msg->buffer[dlc] > 8)
       msg->buffer[dlc] = 8;
+}
+
+
+// Transmit a packet whose header has already been set by canSetHeader - the packet is not changed,
+// so a frame that is sent repeatedly only needs encoding once
+
+BOOL canTXFrame( CanPacket *msg )
+{
+  BYTE* ptr;
+  BOOL  fullUp;
+  BYTE hiIndex;
 
+  if (txBurstReserved)      // Would take an entry reserved for the burst
+  {
+      txOflowCount++;
+      return FALSE;
+  }
 
   TXBnIE = 0;    // Disable transmit buffer interrupt whilst we fiddle with registers and fifo
  
@@ -392,6 +418,92 @@ BOOL canTX( CanPacket *msg )
 }
 
 
+// Reserve entries in the software fifo for a burst of packets, which are then filled using
+// canTXReservedSlot and transmitted together by canTXCommit.
+// Returns false, reserving nothing, if there is not room for the whole burst.
+// No other packets can be transmitted until the burst is committed.
+
+BOOL canTXReserve( BYTE count )
+{
+  BYTE hiIndex;
+
+  if (txBurstReserved || (count == 0) || (count > CANTX_FIFO_LEN) || (txIndexNextFree == 0xFF))
+      return FALSE;
+
+  // The ISR only moves txIndexNextUsed on, so the free space can only grow whilst we look at it
+
+  hiIndex = ( txIndexNextFree < txIndexNextUsed ? txIndexNextFree + CANTX_FIFO_LEN : txIndexNextFree);
+  if ((CANTX_FIFO_LEN - (hiIndex - txIndexNextUsed)) < count)
+  {
+      txOflowCount++;
+      return FALSE;
+  }
+
+  txBurstStart = txIndexNextFree;
+  txBurstReserved = count;
+  txBurstFilled = 0;
+  return TRUE;
+}
+
+
+// Get the next reserved software fifo entry to fill, or NULL if they have all been filled.
+// The packet DLC must be set and canSetHeader called once it has been filled. The ISR does
+// not look at reserved entries so they are filled without disabling interrupts.
+
+CanPacket* canTXReservedSlot( void )
+{
+  BYTE index;
+
+  if (txBurstFilled >= txBurstReserved)
+      return NULL;
+
+  index = txBurstStart + txBurstFilled++;
+  if (index >= CANTX_FIFO_LEN)
+      index -= CANTX_FIFO_LEN;
+  return &canTxFifo[index];
+}
+
+
+// Transmit the filled entries of the burst together and release any reserved entries left unfilled
+
+BOOL canTXCommit( void )
+{
+  BYTE hiIndex;
+
+  if (!txBurstReserved)
+      return FALSE;
+
+  TXBnIE = 0;    // Disable transmit buffer interrupt whilst we fiddle with the fifo
+
+  if (txBurstFilled)
+  {
+      txIndexNextFree = txBurstStart + txBurstFilled;
+      if (txIndexNextFree >= CANTX_FIFO_LEN)
+          txIndexNextFree -= CANTX_FIFO_LEN;
+
+      // Track buffer usage
+
+      txFifoUsage += txBurstFilled;
+      hiIndex = ( txIndexNextFree <= txIndexNextUsed ? txIndexNextFree + CANTX_FIFO_LEN : txIndexNextFree);
+      if ((hiIndex - txIndexNextUsed) > maxCanTxFifo )
+        maxCanTxFifo = hiIndex - txIndexNextUsed;
+
+      if (txIndexNextUsed == txIndexNextFree) // check if fifo now full
+          txIndexNextFree = 0xFF; // mark as full
+  }
+
+  txBurstReserved = 0;
+  txBurstFilled = 0;
+
+  if (!TXB0CONbits.TXREQ)
+      checkTxFifo();  // Transmit buffer idle, so load the first packet - this also sets the interrupt enable
+  else
+      TXBnIE = 1;     // Enable transmit buffer interrupt
+
+  return TRUE;
+}
+
+
 // Queue a packet into the receive buffer
 // This is used to queue outgoing events back into the rx buffer so that the module
 // can be taught its own events
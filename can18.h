@@ -137,6 +137,7 @@ typedef struct {
 
 
 extern BYTE clkMHz;
+extern BYTE canID;
 
 // Diagnostic variables for CAN performance
 
@@ -155,6 +156,11 @@ void canInit(BYTE busNum, BYTE initCanID);
 void setNewCanId( BYTE newCanId );
 BOOL canSend(BYTE *msg, BYTE msgLen);
 BOOL canTX( CanPacket *msg );
+void canSetHeader( CanPacket *msg );
+BOOL canTXFrame( CanPacket *msg );
+BOOL canTXReserve( BYTE count );
+CanPacket* canTXReservedSlot( void );
+BOOL canTXCommit( void );
 BOOL canQueueRx( CanPacket *msg );
 BOOL canbusRecv(CanPacket *msg);
 void canFillRxFifo(void);
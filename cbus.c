@@ -53,6 +53,7 @@
 #include "cbus.h"
 #include "romops.h"
 #include "EEPROM.h"
+#include <stddef.h>
 
 WORD    nodeID;
 BYTE    cbusMsg[pktsize]; // Global buffer for fast access to CBUS packets - do NOT use in ISRs as would not be re-entrant
@@ -193,6 +194,76 @@ void cbusSendEventWithData( BYTE cbusNum, WORD eventNode, WORD eventNum, BOOL on
 
 } // cbusSendEventWithData
 
+#if defined(CBUS_OVER_CAN)
+/*
+ * Send an event frame which has already been fully encoded for CAN, including our can id.
+ * The frame is also queued into the receive buffer so the module can be taught its own events.
+ */
+BOOL cbusSendEventFrame(CanPacket *frame)
+{
+    BOOL success;
+
+    success = canTXFrame( frame );
+    canQueueRx( frame );
+    return success;
+}
+
+/*
+ * Burst send of a group of events, such as setting a route. cbusBurstBegin reserves room in
+ * the CAN transmit fifo for the whole group, returning FALSE up front if it will not fit.
+ * The events are then added with cbusBurstEvent and all transmitted by cbusBurstCommit, so
+ * the group is never cut short by the fifo filling part way through.
+ * No other messages can be sent between cbusBurstBegin and cbusBurstCommit.
+ */
+BOOL cbusBurstBegin(BYTE count)
+{
+    return canTXReserve( count );
+}
+
+/*
+ * Add an event to the burst - eventNode of 0 for a short event, or -1 for our node number.
+ * Returns FALSE if the events reserved by cbusBurstBegin have all been added.
+ */
+BOOL cbusBurstEvent(WORD eventNode, WORD eventNum, BOOL onEvent)
+{
+    CanPacket   *frame;
+
+    if ((frame = canTXReservedSlot()) == NULL)
+        return FALSE;
+
+    frame->buffer[d0] = OPC_ACON;       // Start with long event opcode
+
+    if (eventNode == 0)
+    {
+        frame->buffer[d0] |= 0x08;      // Short event opcode
+        eventNode = nodeID;             // Add module node id for diagnostics
+    }
+    else if (eventNode == -1)
+        eventNode = nodeID;             // Use node id for this module
+
+    if (!onEvent)
+        frame->buffer[d0] |= 0x01;      // Off event
+
+    frame->buffer[d1] = eventNode>>8;
+    frame->buffer[d2] = eventNode & 0xFF;
+    frame->buffer[d3] = eventNum>>8;
+    frame->buffer[d4] = eventNum & 0xFF;
+    frame->buffer[dlc] = 5;
+    canSetHeader( frame );
+
+    canQueueRx( frame );                // Queue event into receive buffer so module can be taught its own events
+    return TRUE;
+}
+
+/*
+ * Transmit the events added to the burst
+ */
+BOOL cbusBurstCommit(void)
+{
+    return canTXCommit();
+}
+#endif
+
 /*
  * Send a CBUS message, putting our Node Number in first two data bytes
  */
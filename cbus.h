@@ -77,6 +77,12 @@ void cbusSendMyEvent( BYTE cbusNum, WORD eventNum, BOOL onEvent );
 void cbusSendEvent( BYTE cbusNum, WORD eventNode, WORD eventNum, BOOL onEvent );
 void cbusSendEventWithData( BYTE cbusNum, WORD eventNode, WORD eventNum, BOOL onEvent, BYTE *msg, BYTE datalen );
 void cbusSendDataEvent(BYTE cbusNum, WORD Node_id, BYTE *debug_data );
+#if defined(CBUS_OVER_CAN)
+BOOL cbusSendEventFrame(CanPacket *frame);
+BOOL cbusBurstBegin(BYTE count);
+BOOL cbusBurstEvent(WORD eventNode, WORD eventNum, BOOL onEvent);
+BOOL cbusBurstCommit(void);
+#endif
 
 
 #endif
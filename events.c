@@ -61,8 +61,21 @@
 void clearEvent2Action(void);
 void rebuildHashtable(void);
 unsigned char getHash(WORD nn, WORD en);
+#if EVENT_HASH_FUNCTION == EVENT_HASH_MODULE
+extern unsigned char moduleEventHash(WORD nn, WORD en);
+#endif
 
+#ifdef EVENT_PROCESS_ACTIONS
+/*
+ * Called by the library to have the module perform all the actions of a consumed event.
+ * actions points at the actions in Flash and is only valid for the duration of the call.
+ * on is TRUE for an ON event and dataLength is the number of data bytes in msg after
+ * the event, from d5.
+ */
+extern void processActions(const BYTE * actions, BYTE count, BOOL on, BYTE dataLength, BYTE * msg);
+#else
 extern void processEvent(unsigned char action, BYTE * msg);
+#endif
 
 //Events are stored in Flash just below NVs
 /*
@@ -73,24 +86,404 @@ const Event action2Event[NUM_PRODUCER_ACTIONS] @AT_ACTION2EVENT = {0}; // should
 
 /*
  * The Event to Action storage.
+ * The event2Action table is held as separate arrays indexed by the same slot: the
+ * events in eventKeys, so that searching and scanning them only reads the keys, and
+ * the offset of each event's actions in the eventActions arena in eventActionRuns.
+ * The actions of an event are kept together as a run: a length byte followed by that
+ * many action bytes, with any unused action bytes at the end of the run set to
+ * NO_ACTION. Runs are allocated from the start of the arena. When an event needs a
+ * longer run its actions are copied to a new one and the old run is abandoned, and
+ * the abandoned runs are removed when the arena fills up. A run never crosses a Flash
+ * block, if it would then the rest of the block is skipped with RUN_PAD bytes.
+ */
+const Event eventKeys[NUM_CONSUMED_EVENTS] @AT_EVENTKEYS;
+const WORD eventActionRuns[NUM_CONSUMED_EVENTS] @AT_EVENTRUNS;     // NO_ACTION_RUN if none
+const BYTE eventActions[EVENT_ACTION_ARENA] @AT_EVENTACTIONS;
+
+#define NO_ACTION_RUN       0xFFFF
+#define RUN_LIVE            0x80        // set in the length byte of a run in use, cleared when abandoned
+#define RUN_END             0xFF        // length byte of the unused space at the end of the arena
+#define RUN_PAD             0x00        // a byte skipped to keep the next run within a Flash block
+#define RUN_LENGTH(b)       ((b) & 0x7F)
+
+#ifdef FLASH_DEFERRED_FLUSH
+/*
+ * Committed changes may still be waiting in the Flash image, see FLASH_DEFERRED_FLUSH, so
+ * received events are looked up by reading the tables through it. Configuration commands
+ * are processed after a flush, so they and the code they call read the tables directly.
+ */
+#define FLASH_READ_BYTE(p)  (flashCommitPending ? readFlashBlock((WORD)(p)) : *(p))
+#define FLASH_READ_WORD(p)  (flashCommitPending ? readFlashWord((WORD)(p)) : *(p))
+#else
+#define FLASH_READ_BYTE(p)  (*(p))
+#define FLASH_READ_WORD(p)  (*(p))
+#endif
+// the offset a run of len actions can start at without crossing a Flash block
+#define RUN_PLACE(p, len)   ((((p) & (_FLASH_WRITE_SIZE-1)) + 1 + (len) > _FLASH_WRITE_SIZE) ? \
+                                (((p) | (_FLASH_WRITE_SIZE-1)) + 1) : (p))
+
+#if (EVperEVT >= 0x7F) || (EVENT_ACTION_ARENA > 0x7FFF)
+#error "EVperEVT must be less than 127 and EVENT_ACTION_ARENA no more than 32767"
+#endif
+#if _FLASH_WRITE_SIZE != FLASH_BLOCK_SIZE
+#error "FLASH_BLOCK_SIZE in module.h does not match this processor"
+#endif
+
+WORD eventActionsTop;       // offset of the unused space at the end of the arena
+WORD eventActionsAbandoned; // bytes in abandoned runs which compaction would recover
+
+BYTE getEventAction(BYTE evtIdx, BYTE a);
+BOOL growActionRun(BYTE evtIdx, BYTE action);
+WORD allocActionRun(BYTE length);
+void freeActionRun(WORD run);
+void padActionRuns(WORD from, WORD to);
+void compactActionRuns(void);
+WORD compactedActionRun(WORD run);
+void rebuildActionRuns(void);
+
+#if NUM_CONSUMED_EVENTS >= NO_INDEX
+#error "NUM_CONSUMED_EVENTS must be less than NO_INDEX"
+#endif
+
+/*
+ * RAM bitmap of the event2Action slots which hold an event, and a count of them,
+ * so the table doesn't need to be read from Flash to find or count unused slots.
+ * Must be kept up to date whenever an event key is written.
+ */
+BYTE eventSlotsUsed[(NUM_CONSUMED_EVENTS+7)/8];
+BYTE eventSlotsUsedCount;
+
+#define EVENT_SLOT_EMPTY(i)     ( ! arrayTestBit(eventSlotsUsed, (i)))
+#define EVENT_KEY_EMPTY(i)      ((eventKeys[i].NN == NO_EVENT_WORD) && (eventKeys[i].EN == NO_EVENT_WORD))
+
+void setEventSlotUsed(BYTE evtIdx);
+void setEventSlotEmpty(BYTE evtIdx);
+BYTE findEmptyEventSlot(void);
+void rebuildEventSlots(void);
+
+#ifdef EVENT_WEAR_LEVELLING
+#ifdef EVENT_SORTED_TABLE
+#error "EVENT_WEAR_LEVELLING can't be used with EVENT_SORTED_TABLE"
+#endif
+/*
+ * An unlearnt event's key is overwritten with a tombstone, which only clears bits so
+ * needs no erase. Its slot isn't reused until the tombstones are reclaimed together,
+ * see reclaimEventSlots. New events take the next unused slot after eventSlotCursor
+ * so that, like a log, teaching works its way round the whole table.
+ */
+#define EVENT_TOMBSTONE_WORD    0x0000
+#define EVENT_KEY_TOMBSTONE(i)  ((eventKeys[i].NN == EVENT_TOMBSTONE_WORD) && (eventKeys[i].EN == EVENT_TOMBSTONE_WORD))
+// reclaim when learn mode is released once this many slots hold tombstones
+#define EVENT_RECLAIM_SLOTS     (NUM_CONSUMED_EVENTS/4)
+
+BYTE eventSlotsDead[(NUM_CONSUMED_EVENTS+7)/8];
+BYTE eventSlotsDeadCount;
+BYTE eventSlotCursor;
+
+void reclaimEventSlots(void);
+#endif
+
+#ifdef ACTION_EVENT_MAP
+/*
+ * For each action a RAM bitmap of the event2Action slots whose events use it,
+ * so deleteAction only needs to read the events that reference the action.
+ */
+BYTE actionEvents[NUM_ACTIONS][(NUM_CONSUMED_EVENTS+7)/8];
+
+void clearEventActions(BYTE evtIdx);
+void rebuildActionEvents(void);
+#endif
+
+void removeEvent(BYTE evtIdx);
+
+#ifdef EVENT_SORTED_TABLE
+/*
+ * The event2Action table is kept sorted by NN then EN, with all the unused slots at
+ * the end, and is searched directly in Flash so there is no index in RAM.
+ */
+void moveEvent2Actions(BYTE to, BYTE from, BYTE count);
+
+#elif defined(EVENT_PERFECT_HASH)
+/*
+ * A perfect hash of the taught events, built when learning finishes and stored in
+ * Flash next to the event2Action table. The events are split into buckets and each
+ * bucket has a displacement which moves the hash of each of its events to a slot
+ * used by no other event, so a lookup needs exactly one key compare. There are
+ * spare slots to make the buckets easy to place. Slots hold the index into
+ * event2Action, or NO_INDEX if unused.
+ * Whilst the hash is out of date, during a learn session, event2Action is searched
+ * from the start instead.
+ */
+#define EVENT_HASH_BUCKETS      64      // must be a power of 2
+#define EVENT_HASH_SLOTS        256     // must be a power of 2 and more than NUM_CONSUMED_EVENTS
+#define EVENT_HASH_MAX_BUCKET   8       // most events allowed to share a bucket
+#define EVENT_HASH_SEEDS        16      // number of hash functions tried before giving up
+#define EVENT_HASH_VALID        0xA5
+
+typedef struct {
+    BYTE seed;
+    BYTE displacements[EVENT_HASH_BUCKETS];
+    BYTE slots[EVENT_HASH_SLOTS];
+    BYTE valid;                         // Last so that it is written after everything else
+} PerfectHash;
+const PerfectHash perfectHash @AT_EVENTHASH;
+WORD perfectHashFailures;   // builds where no seed worked, the table is then searched
+
+void buildPerfectHash(void);
+void invalidatePerfectHash(void);
+WORD getPerfectHash(WORD nn, WORD en, BYTE seed);
+
+#define PERFECT_HASH_BUCKET(h)  ((BYTE)((h) >> 8) & (EVENT_HASH_BUCKETS - 1))
+#define PERFECT_HASH_SLOT(h)    ((h) & (EVENT_HASH_SLOTS - 1))
+#define PERFECT_HASH_WRAP(s)    ((s) & (EVENT_HASH_SLOTS - 1))
+
+#if (EVENT_HASH_SLOTS <= NUM_CONSUMED_EVENTS) || (EVENT_HASH_SLOTS > 256)
+#error "EVENT_HASH_SLOTS must be more than NUM_CONSUMED_EVENTS and no more than 256"
+#endif
+#if (AT_EVENTHASH + 2 + EVENT_HASH_BUCKETS + EVENT_HASH_SLOTS > AT_EVENTKEYS)
+#error "perfectHash overlaps eventKeys, move AT_EVENTHASH down"
+#endif
+
+#else
+#if (EVENT_HASH_LENGTH <= NUM_CONSUMED_EVENTS) || (EVENT_HASH_LENGTH > 256) || ((EVENT_HASH_LENGTH & (EVENT_HASH_LENGTH-1)) != 0)
+#error "EVENT_HASH_LENGTH must be a power of 2, no more than 256 and larger than NUM_CONSUMED_EVENTS"
+#endif
+#if (EVENT_HASH_FUNCTION != EVENT_HASH_XOR) && (EVENT_HASH_FUNCTION != EVENT_HASH_MULTIPLY) && (EVENT_HASH_FUNCTION != EVENT_HASH_MODULE)
+#error "EVENT_HASH_FUNCTION must be EVENT_HASH_XOR, EVENT_HASH_MULTIPLY or EVENT_HASH_MODULE"
+#endif
+// The multiplicative hash takes the top log2(EVENT_HASH_LENGTH) bits of the product
+#if EVENT_HASH_LENGTH == 256
+#define EVENT_HASH_SHIFT    8
+#elif EVENT_HASH_LENGTH == 128
+#define EVENT_HASH_SHIFT    9
+#elif EVENT_HASH_LENGTH == 64
+#define EVENT_HASH_SHIFT    10
+#elif EVENT_HASH_LENGTH == 32
+#define EVENT_HASH_SHIFT    11
+#elif EVENT_HASH_LENGTH == 16
+#define EVENT_HASH_SHIFT    12
+#elif EVENT_HASH_LENGTH == 8
+#define EVENT_HASH_SHIFT    13
+#elif EVENT_HASH_LENGTH == 4
+#define EVENT_HASH_SHIFT    14
+#else
+#define EVENT_HASH_SHIFT    15
+#endif
+
+/*
+ * The hashtable to find the Event within the event2Action table. Stored in RAM.
+ * Uses open addressing with linear probing, each entry is an index into event2Action
+ * or NO_INDEX if unused. eventHashMaxProbe is the longest probe sequence needed
+ * by any event in the table and so bounds the cost of every lookup. As the table
+ * is larger than NUM_CONSUMED_EVENTS every event always has an entry, however the
+ * events are numbered. eventHashDisplacements counts the events moved further from
+ * their hash position to make room for an event which was even further from its own.
+ */
+BYTE eventHashtable[EVENT_HASH_LENGTH];
+BYTE eventHashMaxProbe;
+WORD eventHashDisplacements;
+
+void addHashtableEntry(BYTE evtIdx, unsigned char hash);
+void removeHashtableEntry(BYTE evtIdx);
+#endif
+
+#ifdef EVENT_CACHE_SIZE
+#if (EVENT_CACHE_SIZE < 1) || (EVENT_CACHE_SIZE > 16)
+#error "EVENT_CACHE_SIZE must be from 1 to 16"
+#endif
+/*
+ * A cache of the most recently used consumed events, most recent first. Only events
+ * found in the event2Action table are added. The cache is cleared whenever an event
+ * is removed or events are moved to other slots, so an entry is never out of date.
  */
 typedef struct {
     Event event;
-    BYTE actions[EVperEVT];
-} Event2Action;
-const Event2Action event2Action[NUM_CONSUMED_EVENTS] @AT_EVENT2ACTION;
+    BYTE evtIdx;            // index into event2Action, NO_INDEX if the entry is unused
+} EventCacheEntry;
+EventCacheEntry eventCache[EVENT_CACHE_SIZE];
+WORD eventCacheHits;        // found in the cache
+WORD eventCacheMisses;      // looked up in the event2Action table
+
+BYTE findCachedEvent(WORD nn, WORD en);
+void addCachedEvent(WORD nn, WORD en, BYTE evtIdx);
+void clearEventCache(void);
+#endif
+
+#ifdef SHORT_EVENT_INDEX_SIZE
+#if (SHORT_EVENT_INDEX_SIZE > 128) || ((SHORT_EVENT_INDEX_SIZE & (SHORT_EVENT_INDEX_SIZE-1)) != 0)
+#error "SHORT_EVENT_INDEX_SIZE must be a power of 2 no more than 128"
+#endif
+/*
+ * A direct mapped index of the short events, which are held in event2Action with NN 0.
+ * Each entry is selected by the low bits of the device number and holds the index into
+ * event2Action of a short event with those bits, or NO_INDEX. When several short events
+ * share an entry only one is indexed, the others are found by findEvent(). Lookups
+ * check the event in Flash so an entry which is out of date only costs the compare.
+ */
+BYTE shortEventIndex[SHORT_EVENT_INDEX_SIZE];
+#define SHORT_EVENT_ENTRY(en)   ((en) & (SHORT_EVENT_INDEX_SIZE-1))
+
+BYTE findShortEvent(WORD en);
+void addShortEvent(BYTE evtIdx, WORD en);
+void removeShortEvent(BYTE evtIdx);
+void rebuildShortEventIndex(void);
+#endif
+
+#ifdef NUM_EVENT_RANGES
+#if NUM_EVENT_RANGES >= NO_INDEX
+#error "NUM_EVENT_RANGES must be less than NO_INDEX"
+#endif
+/*
+ * The consumed event ranges. Each covers the event numbers enLo to enHi from one node,
+ * or from any node if NN is EVENT_RANGE_ANY_NN. The ranges are kept sorted by NN then
+ * enLo, with the unused entries at the end, and the ranges for a node never overlap, so
+ * the only range which can hold an event is the last one starting at or before it.
+ * Stored in Flash, 8 bytes each so they lie within a Flash block.
+ */
+typedef struct {
+    WORD NN;
+    WORD enLo;
+    WORD enHi;
+    BYTE action;            // the action for enLo, NO_ACTION if the entry is unused
+    BYTE actionStep;        // 0 for the same action for every event, 1 for consecutive actions
+} EventRange;
+const EventRange eventRanges[NUM_EVENT_RANGES] @AT_EVENTRANGES;
+BYTE eventRangesUsed;       // the used ranges are always at the start
+WORD eventRangesLoEN;       // the lowest and highest event numbers covered by any range,
+WORD eventRangesHiEN;       // so most events skip the search
+
+BYTE findEventRange(WORD nn, WORD en);
+BOOL doRangeActions(const Event * e, BYTE * msg);
+void writeEventRange(BYTE idx, WORD nn, WORD enLo, WORD enHi, BYTE action, BYTE actionStep);
+void removeEventRange(BYTE idx);
+void rebuildEventRanges(void);
+#endif
+
+#ifdef EVENT_STATE_CACHE
+/*
+ * The last state received of each consumed event, indexed like event2Action.
+ * The eventStateKnown bit is set once an ON or OFF has been received and the
+ * eventStateOn bit holds whether it was ON.
+ */
+BYTE eventStateKnown[(NUM_CONSUMED_EVENTS+7)/8];
+BYTE eventStateOn[(NUM_CONSUMED_EVENTS+7)/8];
+WORD eventRepeats;          // events received in the state they were already in
+
+BOOL updateEventState(BYTE evtIdx, BYTE opc);
+void clearEventState(BYTE evtIdx);
+void clearEventStates(void);
+#endif
+
+BYTE lookupConsumedEvent(WORD nn, WORD en);
+
+#ifdef PRODUCED_EVENT_FRAMES
+#if !defined(CBUS_OVER_CAN)
+#error "PRODUCED_EVENT_FRAMES needs CBUS_OVER_CAN"
+#endif
+/*
+ * The ON and OFF frames of each produced action, encoded with our CANID and
+ * node number. A frame with a dlc of 0 has no event taught. The frames are
+ * rebuilt whenever the action2Event table changes, and by sendProducedEvent()
+ * if the CANID or node number is not the one they were built with.
+ */
+CanPacket producedEventFrames[NUM_PRODUCER_ACTIONS][2];
+BYTE producedFramesCanId;
+WORD producedFramesNodeID;
+
+void buildProducedEventFrames(void);
+#endif
 
-// The hashtable to find the Event within the event2Action table. Stored in RAM
-BYTE eventChains[HASH_LENGTH][CHAIN_LENGTH];
+#if defined(EVENT_SORTED_TABLE) && defined(EVENT_PERFECT_HASH)
+#error "Only one of EVENT_SORTED_TABLE and EVENT_PERFECT_HASH may be defined"
+#endif
+
+#ifdef EVENT_BLOOM_BITS
+#if (EVENT_BLOOM_BITS < 128) || (EVENT_BLOOM_BITS > 512) || ((EVENT_BLOOM_BITS & (EVENT_BLOOM_BITS-1)) != 0)
+#error "EVENT_BLOOM_BITS must be a power of 2 from 128 to 512"
+#endif
+/*
+ * A Bloom filter of the consumed events. Each event sets two bits so if either
+ * bit is clear the event is definitely not consumed and the lookup is skipped.
+ * Bits can't be removed so an unlearnt event stays in the filter until the
+ * next rebuild, which only costs a lookup.
+ */
+BYTE eventBloomFilter[EVENT_BLOOM_BITS/8];
+WORD eventBloomHits;            // passed the filter and consumed
+WORD eventBloomMisses;          // rejected by the filter
+WORD eventBloomFalsePositives;  // passed the filter but not consumed
+
+// The filter needs up to 9 bits per index so the two indexes come from separate words
+#define BLOOM_BIT1(h)   ((WORD)(h) & (EVENT_BLOOM_BITS - 1))
+#define BLOOM_BIT2(h)   ((WORD)((h) >> 16) & (EVENT_BLOOM_BITS - 1))
+
+DWORD getBloomHash(WORD nn, WORD en);
+void addBloomEntry(WORD nn, WORD en);
+void rebuildBloomFilter(void);
+#endif
 
 /**
  * eventsInit called during initialisation - initialises event support.
  * Called after power up to initialise RAM.
  */
 void eventsInit( void ) {
+#ifdef PRODUCED_EVENT_FRAMES
+    buildProducedEventFrames();
+#endif
+#ifdef EVENT_CACHE_SIZE
+    clearEventCache();
+#endif
+#ifdef EVENT_STATE_CACHE
+    clearEventStates();
+#endif
+    rebuildEventSlots();
+    rebuildActionRuns();
+#ifdef ACTION_EVENT_MAP
+    rebuildActionEvents();
+#endif
+#ifdef SHORT_EVENT_INDEX_SIZE
+    rebuildShortEventIndex();
+#endif
+#ifdef NUM_EVENT_RANGES
+    rebuildEventRanges();
+#endif
+#ifdef EVENT_PERFECT_HASH
+    // the perfect hash is kept in Flash so only needs building if it is out of date
+    if (perfectHash.valid != EVENT_HASH_VALID) {
+        buildPerfectHash();
+    }
+#ifdef EVENT_BLOOM_BITS
+    rebuildBloomFilter();
+#endif
+#else
     rebuildHashtable();
+#endif
 } //eventsInit
 
+/**
+ * Called when learn mode is released. Brings the event lookup up to date with
+ * any changes made during the learn session.
+ */
+void eventsEndLearn(void) {
+#ifdef EVENT_WEAR_LEVELLING
+    if (eventSlotsDeadCount >= EVENT_RECLAIM_SLOTS) {
+        reclaimEventSlots();
+    }
+#endif
+#ifdef EVENT_PERFECT_HASH
+    if (perfectHash.valid != EVENT_HASH_VALID) {
+        buildPerfectHash();
+    }
+#endif
+#if !defined(EVENT_PERFECT_HASH) && !defined(EVENT_SORTED_TABLE)
+    // unlearnt events leave eventHashMaxProbe as a loose bound so tighten it,
+    // this also rebuilds the Bloom filter
+    rebuildHashtable();
+#elif defined(EVENT_BLOOM_BITS)
+    // drop any unlearnt events
+    rebuildBloomFilter();
+#endif
+}
+
 /**
  * Clear all Events.
  */
@@ -111,15 +504,9 @@ void doNnclr(void) {
  */
 void doNnevn(void)
 {
-    //Pete's original code kept a counter in EEPROM but here I count the number
-    // of unused slots.
-    unsigned char count = 0;
-    for (unsigned char i=0; i<NUM_CONSUMED_EVENTS; i++) {
-        if ((event2Action[i].event.NN == NO_EVENT) && (event2Action[i].event.EN == NO_EVENT)) {
-            count++;
-        }
-    }
-    cbusMsg[d3] = count;
+    //Pete's original code kept a counter in EEPROM but here the count of used
+    // slots is kept in RAM.
+    cbusMsg[d3] = NUM_CONSUMED_EVENTS - eventSlotsUsedCount;
     cbusSendOpcMyNN( 0, OPC_EVNLF, cbusMsg );
 } // doNnevn
 
@@ -130,7 +517,7 @@ void doNerd(void)
     // The CBUS spec doesn't seem to cover what do with the produced events - should we return both and fake an Index?
     unsigned char i;
     for (i=0; i<NUM_PRODUCER_ACTIONS; i++) {
-        if ((action2Event[i].NN != NO_EVENT) || (action2Event[i].EN != NO_EVENT)) {
+        if ((action2Event[i].NN != NO_EVENT_WORD) || (action2Event[i].EN != NO_EVENT_WORD)) {
             cbusMsg[d3] = action2Event[i].NN>>8;
             cbusMsg[d4] = action2Event[i].NN&0xff;
             cbusMsg[d5] = action2Event[i].EN>>8;
@@ -140,12 +527,12 @@ void doNerd(void)
         }
     }
     for (i=0; i<NUM_CONSUMED_EVENTS; i++) {
-        if ((event2Action[i].event.NN != NO_EVENT) || (event2Action[i].event.EN != NO_EVENT)) {
+        if ( ! EVENT_SLOT_EMPTY(i)) {
             //for (unsigned char a=0; a<EVperEvt; a++) {  
-                cbusMsg[d3] = event2Action[i].event.NN>>8;
-                cbusMsg[d4] = event2Action[i].event.NN&0xff;
-                cbusMsg[d5] = event2Action[i].event.EN>>8;
-                cbusMsg[d6] = event2Action[i].event.EN&0xff;
+                cbusMsg[d3] = eventKeys[i].NN>>8;
+                cbusMsg[d4] = eventKeys[i].NN&0xff;
+                cbusMsg[d5] = eventKeys[i].EN>>8;
+                cbusMsg[d6] = eventKeys[i].EN&0xff;
                 cbusMsg[d7] = i;
                 cbusSendOpcMyNN( 0, OPC_ENRSP, cbusMsg );
             //}
@@ -155,19 +542,13 @@ void doNerd(void)
 
 /**
  * Read number of stored events
- * This returned the number of unused slots in the Consumed event Event2Action table.
+ * This returns the number of used slots in the Consumed event Event2Action table.
  */
 void doRqevn(void)
 {
-    //Pete's original code kept a counter in EEPROM but here I count the number
-    // of unused slots.
-    unsigned char count = 0;
-    for (unsigned char i=0; i<NUM_CONSUMED_EVENTS; i++) {
-        if ((event2Action[i].event.NN != NO_EVENT) || (event2Action[i].event.EN != NO_EVENT)) {
-            count++;
-        }
-    }
-    cbusMsg[d3] = count;
+    //Pete's original code kept a counter in EEPROM but here the count of used
+    // slots is kept in RAM.
+    cbusMsg[d3] = eventSlotsUsedCount;
     cbusSendOpcMyNN( 0, OPC_NUMEV, cbusMsg );
 } // doRqevn
 
@@ -181,7 +562,7 @@ void doEvuln(WORD nodeNumber, WORD eventNumber)
     // need to delete this action from the Produced and Consumed tables
     // delete from produced first
     unsigned char a;
-    for (a=0; a<NUM_ACTIONS; a++) {
+    for (a=0; a<NUM_PRODUCER_ACTIONS; a++) {
         if ((eventNumber == action2Event[a].EN) && (nodeNumber == action2Event[a].NN)) {
             writeFlashImage((BYTE*)&(action2Event[a].NN), NO_EVENT);
             writeFlashImage((BYTE*)&(action2Event[a].NN)+1, NO_EVENT);
@@ -191,22 +572,14 @@ void doEvuln(WORD nodeNumber, WORD eventNumber)
     }
     
     // now delete from consumed
-    unsigned char evtIdx;
-    for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
-        if ((eventNumber == event2Action[evtIdx].event.EN) && (nodeNumber == event2Action[evtIdx].event.NN)) {
-            writeFlashImage((BYTE*)&(event2Action[evtIdx].event.NN), NO_EVENT);
-            writeFlashImage((BYTE*)&(event2Action[evtIdx].event.NN)+1, NO_EVENT);
-            writeFlashImage((BYTE*)&(event2Action[evtIdx].event.EN), NO_EVENT);
-            writeFlashImage((BYTE*)&(event2Action[evtIdx].event.EN)+1, NO_EVENT);
-            for (a=0; a<EVperEVT; a++) {
-                writeFlashImage((BYTE*)&(event2Action[evtIdx].actions[a]), NO_ACTION);
-            }
-            // easier to rebuild from scratch
-            rebuildHashtable();
-            return;
-        }
+    unsigned char evtIdx = findEvent(nodeNumber, eventNumber, FALSE);
+    if (evtIdx != NO_INDEX) {
+        removeEvent(evtIdx);
     }
-    flushFlashImage();
+    commitFlashImage();
+#ifdef PRODUCED_EVENT_FRAMES
+    buildProducedEventFrames();
+#endif
 }
 
 /**
@@ -224,7 +597,7 @@ void doReval(void)
     unsigned char idx = cbusMsg[d3];
     unsigned char action = cbusMsg[d4];
     if (idx < NUM_CONSUMED_EVENTS) {
-        cbusMsg[5] = event2Action[idx].actions[action];
+        cbusMsg[5] = getEventAction(idx, action);
         cbusSendOpcMyNN( 0, OPC_NEVAL, cbusMsg );
     } else {
         cbusMsg[d3] = CMDERR_INVALID_EVENT;
@@ -244,23 +617,16 @@ void doReval(void)
 void doReqev(WORD nodeNumber, WORD eventNumber, BYTE evNum)
 {
     // get the event
-    unsigned char hash = getHash(nodeNumber, eventNumber);
-    unsigned char chainIdx;
+    unsigned char evtIdx = findEvent(nodeNumber, eventNumber, FALSE);
  
-    for (chainIdx=0; chainIdx<CHAIN_LENGTH; chainIdx++) {
-        unsigned char evtIdx = eventChains[hash][chainIdx];
-        if (evtIdx == NO_INDEX) return;    // no more left to check - no action
-        // need to check in case of hash collision
-        const Event * otherEvent = (const Event*)&(event2Action[evtIdx].event);
-        if ((eventNumber == otherEvent->EN) && (nodeNumber == otherEvent->NN)) {
-            // found the correct consumed event - now get the action
-            cbusMsg[d3] = eventNumber >> 8;
-            cbusMsg[d4] = eventNumber & 0x00FF;
-            cbusMsg[d5] = evNum;
-            cbusMsg[d6] = event2Action[evtIdx].actions[evNum];
-            cbusSendOpcMyNN( 0, OPC_EVANS, cbusMsg);
-            return;
-        }
+    if ((evtIdx != NO_INDEX) && (evNum < EVperEVT)) {
+        // found the correct consumed event - now get the action
+        cbusMsg[d3] = eventNumber >> 8;
+        cbusMsg[d4] = eventNumber & 0x00FF;
+        cbusMsg[d5] = evNum;
+        cbusMsg[d6] = getEventAction(evtIdx, evNum);
+        cbusSendOpcMyNN( 0, OPC_EVANS, cbusMsg);
+        return;
     }
     cbusMsg[d3] = CMDERR_INVALID_EVENT;
     cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
@@ -290,178 +656,1213 @@ void doEvlrn(WORD nodeNumber, WORD eventNumber, BYTE evNum, BYTE evVal ) {
         writeFlashImage((BYTE*)&action2Event[evVal].NN+1, nodeNumber >> 8);
         writeFlashImage((BYTE*)&action2Event[evVal].EN, eventNumber & 0xff);
         writeFlashImage((BYTE*)&action2Event[evVal].EN+1, eventNumber >> 8);
-        flushFlashImage();
+        commitFlashImage();
+#ifdef PRODUCED_EVENT_FRAMES
+        buildProducedEventFrames();
+#endif
         cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
         return;
     } else {
         // teach a CONSUMED action
-        // check it we already have this event
-        unsigned char hash = getHash(nodeNumber, eventNumber);
-        unsigned char chainIdx;
-        for (chainIdx=0; chainIdx<CHAIN_LENGTH; chainIdx++) {
-            unsigned char evtIdx = eventChains[hash][chainIdx];
-            if (evtIdx == NO_INDEX) {
-                // it isn't in the table
-                // find a slot in the table
-                for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
-                    if ((event2Action[evtIdx].event.NN == NO_EVENT) && (event2Action[evtIdx].event.EN == NO_EVENT)) {
-                        // found a spare slot
-                        eventChains[hash][chainIdx] = evtIdx;
-                        writeFlashImage((BYTE*)&(event2Action[evtIdx].event.NN), nodeNumber & 0xff);
-                        writeFlashImage((BYTE*)&(event2Action[evtIdx].event.NN)+1, nodeNumber >> 8);
-                        writeFlashImage((BYTE*)&(event2Action[evtIdx].event.EN), eventNumber & 0xff);
-                        writeFlashImage((BYTE*)&(event2Action[evtIdx].event.EN)+1, eventNumber >> 8);
-                        writeFlashImage((BYTE*)&(event2Action[evtIdx].actions[0]), evVal);
-                        flushFlashImage();
-                        cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
-                        return;
-                    } 
+#ifdef EVENT_WEAR_LEVELLING
+        if ((nodeNumber == EVENT_TOMBSTONE_WORD) && (eventNumber == EVENT_TOMBSTONE_WORD)) {
+            // can't be told apart from an unlearnt event
+            cbusMsg[d3] = CMDERR_INVALID_EVENT;
+            cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+            return;
+        }
+#endif
+        // check it we already have this event, adding it to the table if not
+        unsigned char evtIdx = findEvent(nodeNumber, eventNumber, TRUE);
+        if (evtIdx == NO_INDEX) {
+            // no slots available
+            cbusMsg[d3] = CMDERR_TOO_MANY_EVENTS;
+            cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+            return;
+        }
+#ifdef SHORT_EVENT_INDEX_SIZE
+        if (nodeNumber == 0) {
+            addShortEvent(evtIdx, eventNumber);
+        }
+#endif
+#ifdef EVENT_BLOOM_BITS
+        addBloomEntry(nodeNumber, eventNumber);
+#endif
+        // now add this action to the list
+        // look for a spare action space in the event's run
+        WORD run = eventActionRuns[evtIdx];
+        unsigned char a;
+        unsigned char len = 0;
+        if (run != NO_ACTION_RUN) {
+            len = RUN_LENGTH(eventActions[run]);
+            for (a=0; a<len; a++) {
+                if (eventActions[run+1+a] == evVal) {
+                    // already there
+                    //WRACK or CmdErr?
+                    commitFlashImage();
+                    cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
+                    return;
+                }
+                if (eventActions[run+1+a] == NO_ACTION) {
+                    writeFlashImage((BYTE*)&(eventActions[run+1+a]), evVal);
+                    commitFlashImage();
+#ifdef ACTION_EVENT_MAP
+                    arraySetBit(actionEvents[evVal], evtIdx);
+#endif
+                    cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
+                    return;
+                }
+            }
+        }
+        if (len >= EVperEVT) {
+            // ERROR = NO EVs left
+            cbusMsg[d3] = CMDERR_INV_EV_IDX;
+            cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+            return;
+        }
+        // the run is full so needs to be longer
+        if ( ! growActionRun(evtIdx, evVal)) {
+            // no room left in the arena
+            if (len == 0) {
+                // only just added for this action so remove it again
+                flushFlashImage();      // removeEvent reads the new key back from Flash
+                removeEvent(evtIdx);
+                commitFlashImage();
+            }
+            cbusMsg[d3] = CMDERR_TOO_MANY_EVENTS;
+            cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+            return;
+        }
+#ifdef ACTION_EVENT_MAP
+        arraySetBit(actionEvents[evVal], evtIdx);
+#endif
+        cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
+    }
+}
+
+/**
+ * Remove an event and all its actions from the event2Action table, updating
+ * the index to match. The caller must flush the Flash image afterwards.
+ * @param evtIdx the index into event2Action
+ */
+void removeEvent(BYTE evtIdx) {
+#ifdef EVENT_CACHE_SIZE
+    clearEventCache();
+#endif
+#ifdef SHORT_EVENT_INDEX_SIZE
+    removeShortEvent(evtIdx);
+#endif
+    if (eventActionRuns[evtIdx] != NO_ACTION_RUN) {
+        freeActionRun(eventActionRuns[evtIdx]);
+    }
+#if defined(EVENT_PERFECT_HASH)
+    invalidatePerfectHash();
+#elif ! defined(EVENT_SORTED_TABLE)
+    removeHashtableEntry(evtIdx);
+#endif
+#ifdef EVENT_SORTED_TABLE
+    // close the gap by moving each following event down one slot
+    moveEvent2Actions(evtIdx, evtIdx+1, eventSlotsUsedCount-1-evtIdx);
+    evtIdx = eventSlotsUsedCount-1;
+#endif
+#ifdef EVENT_WEAR_LEVELLING
+    // leave a tombstone. The offset of the actions is left pointing at the abandoned run,
+    // so everything reading it must check the slot is in use first, see getEventAction.
+    setFlashWord((WORD*)&(eventKeys[evtIdx].NN), EVENT_TOMBSTONE_WORD);
+    setFlashWord((WORD*)&(eventKeys[evtIdx].EN), EVENT_TOMBSTONE_WORD);
+    if ( ! arrayTestBit(eventSlotsDead, evtIdx)) {
+        arraySetBit(eventSlotsDead, evtIdx);
+        eventSlotsDeadCount++;
+    }
+#else
+    writeFlashImage((BYTE*)&(eventKeys[evtIdx].NN), NO_EVENT);
+    writeFlashImage((BYTE*)&(eventKeys[evtIdx].NN)+1, NO_EVENT);
+    writeFlashImage((BYTE*)&(eventKeys[evtIdx].EN), NO_EVENT);
+    writeFlashImage((BYTE*)&(eventKeys[evtIdx].EN)+1, NO_EVENT);
+    setFlashWord((WORD*)&(eventActionRuns[evtIdx]), NO_ACTION_RUN);
+#endif
+    setEventSlotEmpty(evtIdx);
+#ifdef ACTION_EVENT_MAP
+    clearEventActions(evtIdx);
+#endif
+#ifdef EVENT_STATE_CACHE
+    clearEventState(evtIdx);
+#endif
+}
+
+#ifdef EVENT_SORTED_TABLE
+/**
+ * Find a consumed event in the sorted event2Action table using a binary search.
+ * This takes at most log2(NUM_CONSUMED_EVENTS)+1 reads of an event from Flash.
+ * @param eventNode the event NN
+ * @param eventNum the event EN
+ * @param createEntry if TRUE and the event is not in the table then it is inserted
+ *        in sorted order, with no actions
+ * @return the index into event2Action, or NO_INDEX if not found and not created
+ */
+BYTE findEvent(WORD eventNode, WORD eventNum, BOOL createEntry) {
+    unsigned char lo = 0;
+    unsigned char hi = NUM_CONSUMED_EVENTS;
+    unsigned char mid;
+
+    if ((eventNode == NO_EVENT_WORD) && (eventNum == NO_EVENT_WORD)) return NO_INDEX;  // marks an unused slot
+
+    // find the first slot that is not less than the event, unused slots sort last
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        WORD nn = FLASH_READ_WORD(&eventKeys[mid].NN);
+        if ((nn < eventNode) || ((nn == eventNode) && (FLASH_READ_WORD(&eventKeys[mid].EN) < eventNum))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ((lo < NUM_CONSUMED_EVENTS) && (eventNum == FLASH_READ_WORD(&eventKeys[lo].EN))
+            && (eventNode == FLASH_READ_WORD(&eventKeys[lo].NN))) {
+        return lo;
+    }
+    if ( ! createEntry) return NO_INDEX;
+    if ( ! EVENT_SLOT_EMPTY(NUM_CONSUMED_EVENTS-1)) return NO_INDEX;    // table is full
+
+    // make room by moving each following event up one slot, starting from the end
+#ifdef EVENT_CACHE_SIZE
+    clearEventCache();
+#endif
+    moveEvent2Actions(lo+1, lo, eventSlotsUsedCount-lo);
+    setFlashWord((WORD*)&(eventKeys[lo].NN), eventNode);
+    setFlashWord((WORD*)&(eventKeys[lo].EN), eventNum);
+    setFlashWord((WORD*)&(eventActionRuns[lo]), NO_ACTION_RUN);
+#ifdef ACTION_EVENT_MAP
+    clearEventActions(lo);
+#endif
+#ifdef EVENT_STATE_CACHE
+    clearEventState(lo);
+#endif
+    setEventSlotUsed(eventSlotsUsedCount);     // the used slots are always at the start
+    flushFlashImage();  // so the moved events can be read back from Flash
+    return lo;
+}
+
+/**
+ * Copy a group of consecutive events and the offsets of their actions to another
+ * position in the event2Action table. The keys are all copied before the offsets so
+ * that the Flash image only moves forward through each array. The groups may overlap.
+ * The source slots are read from Flash so must not have been changed since the last flush.
+ * @param to the destination index into event2Action
+ * @param from the source index into event2Action
+ * @param count the number of events to copy
+ */
+void moveEvent2Actions(BYTE to, BYTE from, BYTE count) {
+    unsigned char i, t, f;
+    signed char step = 1;
+    if (count == 0) return;
+#ifdef SHORT_EVENT_INDEX_SIZE
+    // the indexed short events move with the rest
+    for (i=0; i<SHORT_EVENT_INDEX_SIZE; i++) {
+        f = shortEventIndex[i];
+        if ((f != NO_INDEX) && (f >= from) && (f-from < count)) {
+            shortEventIndex[i] = f - from + to;
+        }
+    }
+#endif
+    if (to > from) {
+        // copy from the end so an overlapping source is read before it is overwritten
+        to += count-1;
+        from += count-1;
+        step = -1;
+    }
+    for (t=to, f=from, i=count; i>0; t+=step, f+=step, i--) {
+        setFlashWord((WORD*)&(eventKeys[t].NN), eventKeys[f].NN);
+        setFlashWord((WORD*)&(eventKeys[t].EN), eventKeys[f].EN);
+    }
+    for (t=to, f=from, i=count; i>0; t+=step, f+=step, i--) {
+        setFlashWord((WORD*)&(eventActionRuns[t]), eventActionRuns[f]);
+    }
+#ifdef ACTION_EVENT_MAP
+    for (t=to, f=from, i=count; i>0; t+=step, f+=step, i--) {
+        unsigned char a;
+        for (a=0; a<NUM_ACTIONS; a++) {
+            if (arrayTestBit(actionEvents[a], f)) {
+                arraySetBit(actionEvents[a], t);
+            } else {
+                arrayClearBit(actionEvents[a], t);
+            }
+        }
+    }
+#endif
+#ifdef EVENT_STATE_CACHE
+    for (t=to, f=from, i=count; i>0; t+=step, f+=step, i--) {
+        if (arrayTestBit(eventStateKnown, f)) {
+            arraySetBit(eventStateKnown, t);
+        } else {
+            arrayClearBit(eventStateKnown, t);
+        }
+        if (arrayTestBit(eventStateOn, f)) {
+            arraySetBit(eventStateOn, t);
+        } else {
+            arrayClearBit(eventStateOn, t);
+        }
+    }
+#endif
+}
+
+#elif defined(EVENT_PERFECT_HASH)
+/**
+ * Find a consumed event in the event2Action table using the perfect hash.
+ * If the perfect hash is out of date then the table is searched from the start.
+ * @param eventNode the event NN
+ * @param eventNum the event EN
+ * @param createEntry if TRUE and the event is not in the table then it is added
+ *        using the first spare slot in event2Action, with no actions
+ * @return the index into event2Action, or NO_INDEX if not found and not created
+ */
+BYTE findEvent(WORD eventNode, WORD eventNum, BOOL createEntry) {
+    unsigned char evtIdx;
+    unsigned char spareIdx;
+
+    if (perfectHash.valid == EVENT_HASH_VALID) {
+        WORD h = getPerfectHash(eventNode, eventNum, perfectHash.seed);
+        evtIdx = perfectHash.slots[PERFECT_HASH_WRAP(h + perfectHash.displacements[PERFECT_HASH_BUCKET(h)])];
+        if ((evtIdx != NO_INDEX) && (eventNum == FLASH_READ_WORD(&eventKeys[evtIdx].EN))
+                && (eventNode == FLASH_READ_WORD(&eventKeys[evtIdx].NN))) {
+            return evtIdx;
+        }
+        if ( ! createEntry) return NO_INDEX;
+    } else {
+        // hash is out of date so check every used slot
+        for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+            if (( ! EVENT_SLOT_EMPTY(evtIdx)) && (eventNum == FLASH_READ_WORD(&eventKeys[evtIdx].EN))
+                    && (eventNode == FLASH_READ_WORD(&eventKeys[evtIdx].NN))) {
+                return evtIdx;
+            }
+        }
+        if ( ! createEntry) return NO_INDEX;
+    }
+    // it isn't in the table so use a spare slot
+    spareIdx = findEmptyEventSlot();
+    if (spareIdx != NO_INDEX) {
+        invalidatePerfectHash();
+        setFlashWord((WORD*)&(eventKeys[spareIdx].NN), eventNode);
+        setFlashWord((WORD*)&(eventKeys[spareIdx].EN), eventNum);
+        setEventSlotUsed(spareIdx);
+    }
+    return spareIdx;
+}
+
+/**
+ * Obtain the perfect hash value for an event. The bucket is taken from the high
+ * bits and the slot from the low bits, see PERFECT_HASH_BUCKET and PERFECT_HASH_SLOT.
+ * @param nn the event NN
+ * @param en the event EN
+ * @param seed selects one of a family of hash functions
+ * @return the hash value
+ */
+WORD getPerfectHash(WORD nn, WORD en, BYTE seed) {
+    WORD h;
+    h = (nn ^ (((WORD)seed << 8) | seed)) * 0x9E37 + en;
+    h ^= h >> 7;
+    h *= 0x6B43;
+    h ^= h >> 9;
+    return h;
+}
+
+/**
+ * Mark the perfect hash as out of date. Only clears bits so needs no erase.
+ */
+void invalidatePerfectHash(void) {
+    if (perfectHash.valid == EVENT_HASH_VALID) {
+        writeFlashByte((BYTE*)&(perfectHash.valid), 0);
+    }
+}
+
+/**
+ * Build the perfect hash for the events currently in the event2Action table and
+ * write it to Flash. The largest buckets are placed first, each taking the
+ * smallest displacement which moves all its events to unused slots. If a bucket
+ * has too many events, or cannot be placed, the next seed is tried.
+ * If no seed works the hash is left out of date, findEvent searches the table
+ * and perfectHashFailures is incremented.
+ * Each bucket's entry in buckets holds its event count until it is placed and
+ * then its displacement.
+ */
+void buildPerfectHash(void) {
+    BYTE buckets[EVENT_HASH_BUCKETS];
+    BYTE placed[EVENT_HASH_BUCKETS/8];
+    BYTE used[EVENT_HASH_SLOTS/8];
+    BYTE bucketSlots[EVENT_HASH_MAX_BUCKET];
+    BYTE seed, size, bucket, evtIdx, n, i, j;
+    BOOL ok;
+    WORD h, d, slot, slotEnd;
+
+    invalidatePerfectHash();
+    for (seed=0; seed<EVENT_HASH_SEEDS; seed++) {
+        // count the events in each bucket
+        for (bucket=0; bucket<EVENT_HASH_BUCKETS; bucket++) {
+            buckets[bucket] = 0;
+        }
+        for (i=0; i<sizeof(placed); i++) {
+            placed[i] = 0;
+        }
+        for (i=0; i<sizeof(used); i++) {
+            used[i] = 0;
+        }
+        ok = TRUE;
+        for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+            if ( ! EVENT_SLOT_EMPTY(evtIdx)) {
+                h = getPerfectHash(eventKeys[evtIdx].NN, eventKeys[evtIdx].EN, seed);
+                if (++buckets[PERFECT_HASH_BUCKET(h)] > EVENT_HASH_MAX_BUCKET) {
+                    ok = FALSE;
                 }
-                // no slots available
-                cbusSendOpcMyNN( 0, CMDERR_TOO_MANY_EVENTS, cbusMsg);
-                return;
             }
-            // need to check in case of hash collision
-            const Event * otherEvent = (const Event*)&(event2Action[evtIdx].event);
-            if ((eventNumber == otherEvent->EN) && (nodeNumber == otherEvent->NN)) {
-                // found the correct consumed event - now add this action to the list
-                // look for a spare action space
-                unsigned char a;
-                for (a=0; a<EVperEVT; a++) {
-                    if (event2Action[evtIdx].actions[a] == evVal) {
-                        // already there
-                        //WRACK or CmdErr?
-                        cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
-                        return;
+        }
+        // place the buckets, largest first. The empty buckets keep 0 as their displacement
+        for (size=EVENT_HASH_MAX_BUCKET; ok && (size>0); size--) {
+            for (bucket=0; ok && (bucket<EVENT_HASH_BUCKETS); bucket++) {
+                if ((buckets[bucket] != size) || arrayTestBit(placed, bucket)) continue;
+                // collect the slots of the events in this bucket, they must all differ
+                n = 0;
+                for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+                    if ( ! EVENT_SLOT_EMPTY(evtIdx)) {
+                        h = getPerfectHash(eventKeys[evtIdx].NN, eventKeys[evtIdx].EN, seed);
+                        if (PERFECT_HASH_BUCKET(h) == bucket) {
+                            bucketSlots[n] = PERFECT_HASH_SLOT(h);
+                            for (j=0; j<n; j++) {
+                                if (bucketSlots[j] == bucketSlots[n]) ok = FALSE;
+                            }
+                            n++;
+                        }
+                    }
+                }
+                // find the first displacement that puts all of them in unused slots
+                for (d=0; ok && (d<EVENT_HASH_SLOTS); d++) {
+                    for (i=0; i<n; i++) {
+                        slot = PERFECT_HASH_WRAP(bucketSlots[i] + d);
+                        if (arrayTestBit(used, slot)) break;
                     }
-                    if (event2Action[evtIdx].actions[a] == NO_ACTION) {
-                        writeFlashByte((BYTE*)&(event2Action[evtIdx].actions[a]), evVal);
-                        cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
-                        return;
+                    if (i == n) break;
+                }
+                if (d == EVENT_HASH_SLOTS) ok = FALSE;
+                if (ok) {
+                    buckets[bucket] = d;
+                    arraySetBit(placed, bucket);
+                    for (i=0; i<n; i++) {
+                        slot = PERFECT_HASH_WRAP(bucketSlots[i] + d);
+                        arraySetBit(used, slot);
                     }
                 }
-                // ERROR = NO EVs left
-                cbusSendOpcMyNN( 0, CMDERR_INV_EV_IDX, cbusMsg);
-                return;
             }
         }
+        if (ok) break;
+    }
+    if ( ! ok) {
+        perfectHashFailures++;
+        return;
+    }
+
+    // write the hash to Flash
+    writeFlashImage((BYTE*)&(perfectHash.seed), seed);
+    for (bucket=0; bucket<EVENT_HASH_BUCKETS; bucket++) {
+        writeFlashImage((BYTE*)&(perfectHash.displacements[bucket]), buckets[bucket]);
+    }
+    // fill the slots one Flash block at a time so each block is only written once
+    slot = 0;
+    while (slot < EVENT_HASH_SLOTS) {
+        slotEnd = slot + _FLASH_WRITE_SIZE - ((WORD)&(perfectHash.slots[slot]) & (_FLASH_WRITE_SIZE - 1));
+        if (slotEnd > EVENT_HASH_SLOTS) slotEnd = EVENT_HASH_SLOTS;
+        fillFlashRange((BYTE*)&(perfectHash.slots[slot]), NO_INDEX, slotEnd - slot);
+        for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+            if ( ! EVENT_SLOT_EMPTY(evtIdx)) {
+                h = getPerfectHash(eventKeys[evtIdx].NN, eventKeys[evtIdx].EN, seed);
+                h = PERFECT_HASH_WRAP(h + buckets[PERFECT_HASH_BUCKET(h)]);
+                if ((h >= slot) && (h < slotEnd)) {
+                    writeFlashImage((BYTE*)&(perfectHash.slots[h]), evtIdx);
+                }
+            }
+        }
+        slot = slotEnd;
+    }
+    writeFlashByte((BYTE*)&(perfectHash.valid), EVENT_HASH_VALID);
+}
+
+#else
+/**
+ * Find a consumed event in the event2Action table using the hashtable.
+ * The lookup stops at the first unused hashtable entry, and never probes further
+ * than the longest probe sequence of any event in the table.
+ * @param eventNode the event NN
+ * @param eventNum the event EN
+ * @param createEntry if TRUE and the event is not in the table then it is added
+ *        using the first spare slot in event2Action, with no actions
+ * @return the index into event2Action, or NO_INDEX if not found and not created
+ */
+BYTE findEvent(WORD eventNode, WORD eventNum, BOOL createEntry) {
+    unsigned char hash = getHash(eventNode, eventNum);
+    unsigned char probe;
+    unsigned char evtIdx;
+
+    for (probe=0; probe<=eventHashMaxProbe; probe++) {
+        evtIdx = eventHashtable[hash];
+        if (evtIdx == NO_INDEX) break;      // no more left to check
+        // need to check in case of hash collision
+        if ((eventNum == FLASH_READ_WORD(&eventKeys[evtIdx].EN)) && (eventNode == FLASH_READ_WORD(&eventKeys[evtIdx].NN))) {
+            return evtIdx;
+        }
+        hash = (hash + 1) & (EVENT_HASH_LENGTH - 1);
+    }
+    if ( ! createEntry) return NO_INDEX;
+
+    // it isn't in the table so use a spare slot
+    evtIdx = findEmptyEventSlot();
+    if (evtIdx != NO_INDEX) {
+        setFlashWord((WORD*)&(eventKeys[evtIdx].NN), eventNode);
+        setFlashWord((WORD*)&(eventKeys[evtIdx].EN), eventNum);
+        setEventSlotUsed(evtIdx);
+        // the new key may not be flushed yet so can't be read back from Flash
+        addHashtableEntry(evtIdx, getHash(eventNode, eventNum));
+    }
+    return evtIdx;
+}
+
+/**
+ * Add an event2Action slot to the hashtable, in the first unused entry at or
+ * after its hash.
+ * Uses Robin Hood insertion: if an entry on the way is closer to its own hash
+ * position than the event being added is, the event takes that entry and the one
+ * displaced carries on along the probe sequence instead. This evens out the probe
+ * lengths so a cluster of events with the same hash can't push a few of them a
+ * long way from home, which keeps eventHashMaxProbe and so every lookup short.
+ * The events in the table must have been flushed to Flash as their hashes are
+ * recalculated from eventKeys, the event being added need not have been.
+ * @param evtIdx the index into event2Action
+ * @param hash the hash of the event
+ */
+void addHashtableEntry(BYTE evtIdx, unsigned char hash) {
+    unsigned char probe = 0;
+    unsigned char other, otherProbe;
+
+    // there is always an unused entry as EVENT_HASH_LENGTH > NUM_CONSUMED_EVENTS
+    while ((other = eventHashtable[hash]) != NO_INDEX) {
+        otherProbe = (hash - getHash(eventKeys[other].NN, eventKeys[other].EN)) & (EVENT_HASH_LENGTH - 1);
+        if (otherProbe < probe) {
+            // take the entry and carry on with the displaced event
+            eventHashtable[hash] = evtIdx;
+            if (probe > eventHashMaxProbe) {
+                eventHashMaxProbe = probe;
+            }
+            evtIdx = other;
+            probe = otherProbe;
+            eventHashDisplacements++;
+        }
+        hash = (hash + 1) & (EVENT_HASH_LENGTH - 1);
+        probe++;
+    }
+    eventHashtable[hash] = evtIdx;
+    if (probe > eventHashMaxProbe) {
+        eventHashMaxProbe = probe;
+    }
+}
+
+/**
+ * Remove an event from the RAM hashtable. Must be called whilst the event is
+ * still in the event2Action table as its hash is needed to find it.
+ * Uses backward shift deletion: following entries in the probe run are moved
+ * back into the gap if that is no further than their own hash position, so no
+ * tombstones are needed and the rest of the hashtable is untouched.
+ * eventHashMaxProbe is left alone as it remains an upper bound.
+ * @param evtIdx the index into event2Action
+ */
+void removeHashtableEntry(BYTE evtIdx) {
+    unsigned char gap = getHash(eventKeys[evtIdx].NN, eventKeys[evtIdx].EN);
+    unsigned char next, home, probe;
+
+    for (probe=0; eventHashtable[gap] != evtIdx; probe++) {
+        if ((eventHashtable[gap] == NO_INDEX) || (probe > eventHashMaxProbe)) return;   // not in the hashtable
+        gap = (gap + 1) & (EVENT_HASH_LENGTH - 1);
+    }
+    eventHashtable[gap] = NO_INDEX;
+    next = gap;
+    for (;;) {
+        next = (next + 1) & (EVENT_HASH_LENGTH - 1);
+        if (eventHashtable[next] == NO_INDEX) return;
+        home = getHash(eventKeys[eventHashtable[next]].NN, eventKeys[eventHashtable[next]].EN);
+        // move it if the gap is between its hash position and where it is now
+        if (((next - home) & (EVENT_HASH_LENGTH - 1)) >= ((next - gap) & (EVENT_HASH_LENGTH - 1))) {
+            eventHashtable[gap] = eventHashtable[next];
+            eventHashtable[next] = NO_INDEX;
+            gap = next;
+        }
     }
 }
 
 
 /**
- * Obtain a hash for the specified Event. 
- * 
- * The hash table uses an algorithm of an XOR of all the bytes with appropriate shifts.
+ * Obtain a hash for the specified Event, using the function selected by
+ * EVENT_HASH_FUNCTION.
  * 
  * If we used just the node number, then all short events would hash to the same number
  * If we used just the event number, then for long events the vast majority would 
  * be 1 to 8, so not giving a very good spread.
  *
- * This algorithm hopefully produces a good spread for layouts with either
- * predominantly short events, long events or a mixture.
- * This also means that for layouts using the default FLiM node numbers from 256, 
- * we are effectively starting from zero as far as the hash algorithm is concerned.
+ * EVENT_HASH_XOR uses an XOR of all the bytes with appropriate shifts. For layouts
+ * using the default FLiM node numbers from 256 we are effectively starting from
+ * zero, but consecutive events hash to consecutive entries. With linear probing
+ * these runs merge into long probe sequences once the table fills up.
+ *
+ * EVENT_HASH_MULTIPLY combines the NN and EN and then multiplies by 40503, which is
+ * 2^16 divided by the golden ratio, taking the hash from the top bits of the product,
+ * as many as EVENT_HASH_LENGTH needs. These depend on every bit of the key, where the
+ * lower bits of the top byte used for a smaller table would not. Consecutive
+ * numbers are scattered across the table, so probe sequences stay short whether the
+ * layout uses short events, long events, consecutive node numbers or ranges of
+ * events, see bench/hash_bench.c. The multiplies are done in hardware on the PIC18.
  * 
- * @param e the event
+ * @param nn the event NN
+ * @param en the event EN
  * @return the hash
  */
 unsigned char getHash(WORD nn, WORD en) {
     unsigned char hash;
-    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
+    // need to hash the NN and EN to a uniform distribution across EVENT_HASH_LENGTH
+#if EVENT_HASH_FUNCTION == EVENT_HASH_XOR
     hash = nn ^ (nn >> 8);
     hash = 7*hash + (en ^ (en>>8)); 
-    // ensure it is within bounds of eventChains
-    hash %= HASH_LENGTH;
+#elif EVENT_HASH_FUNCTION == EVENT_HASH_MULTIPLY
+    WORD key = (WORD)(nn * 31) ^ en;
+    hash = (WORD)(key * 40503u) >> EVENT_HASH_SHIFT;
+#else
+    hash = moduleEventHash(nn, en);
+#endif
+    // ensure it is within bounds of eventHashtable
+    hash &= (EVENT_HASH_LENGTH - 1);
     return hash;
 }
+#endif
 
 
 /**
  * This Consumes a CBUS event if it has been provisioned.
+ * Short events are held with NN 0. Those taught before that were held with the
+ * node number of the sender, so if a short event isn't found with NN 0 it is
+ * looked for again in that form. Reteaching them with NN 0 avoids the second lookup.
  * @param msg
  * @return 
  */
 BOOL parseCbusEvent(BYTE * msg) {
     Event evt;
-    evt.NN = (msg[d1] << 8) + msg[d2];
+    BYTE result;
+    // a short event is just the device number, d1/d2 are the sender's node number
+    evt.NN = IS_SHORT_EVENT_OPC(msg[d0]) ? 0 : (msg[d1] << 8) + msg[d2];
     evt.EN = (msg[d3] << 8) + msg[d4];
-    return doActions(&evt, msg);
+    result = doConsumedEvent(&evt, msg);
+    if ((result != EVENT_CONSUMED) && IS_SHORT_EVENT_OPC(msg[d0])) {
+        evt.NN = (msg[d1] << 8) + msg[d2];
+        // keep a filter pass from the first lookup so it is counted as a false positive
+        result |= doConsumedEvent(&evt, msg);
+        evt.NN = 0;
+    }
+#ifdef EVENT_BLOOM_BITS
+    // counted once per received event whichever lookups were made
+    switch (result) {
+        case EVENT_FILTERED:
+            eventBloomMisses++;
+            break;
+        case EVENT_NOT_CONSUMED:
+            eventBloomFalsePositives++;
+            break;
+        default:
+            eventBloomHits++;
+            break;
+    }
+#endif
+#ifdef NUM_EVENT_RANGES
+    // the ranges aren't in the Bloom filter so are always checked
+    if (doRangeActions(&evt, msg)) {
+        return TRUE;
+    }
+#endif
+    return result == EVENT_CONSUMED;
 } 
 
-
 /**
- * Clear all the actions' events.
+ * Perform the actions of a consumed event, checking the Bloom filter first.
+ * @param e the event
+ * @param msg the received message
+ * @return EVENT_FILTERED if rejected by the Bloom filter, EVENT_NOT_CONSUMED if
+ * looked up but not found and EVENT_CONSUMED if an action was processed
  */
-void clearAction2Event(void) {
-    unsigned char action;
-    for (action=0; action<NUM_ACTIONS; action++) {
-        writeFlashImage((BYTE*)&action2Event[action].NN, NO_INDEX);
-        writeFlashImage((BYTE*)&action2Event[action].NN+1, NO_INDEX);
-        writeFlashImage((BYTE*)&action2Event[action].EN, NO_INDEX);
-        writeFlashImage((BYTE*)&action2Event[action].EN+1, NO_INDEX);
+BYTE doConsumedEvent(const Event * e, BYTE * msg) {
+#ifdef EVENT_BLOOM_BITS
+    DWORD h = getBloomHash(e->NN, e->EN);
+    if ( ! arrayTestBit(eventBloomFilter, BLOOM_BIT1(h)) || ! arrayTestBit(eventBloomFilter, BLOOM_BIT2(h))) {
+        return EVENT_FILTERED;
     }
-    flushFlashImage();
+#endif
+    return doActions(e, msg) ? EVENT_CONSUMED : EVENT_NOT_CONSUMED;
 }
 
-void clearEvent2Action(void) {
-    unsigned char idx;
-    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
-        unsigned char j;
-        for (j=0; j<sizeof(Event2Action); j++) {
-            writeFlashByte((BYTE*)&event2Action[idx]+j, NO_ACTION);
-        }
-    }
+#ifdef EVENT_BLOOM_BITS
+/**
+ * Obtain the Bloom filter hash for an event. This is two independent 16 bit
+ * hashes, the low word giving BLOOM_BIT1 and the high word BLOOM_BIT2, so the
+ * two bits don't share any hash bits. 16 bit multiplies are kept as they are
+ * much cheaper than a 32 bit one on the PIC.
+ * @param nn the event NN
+ * @param en the event EN
+ * @return the two hashes
+ */
+DWORD getBloomHash(WORD nn, WORD en) {
+    WORD h1;
+    WORD h2;
+    h1 = (nn ^ (nn >> 8)) * 0x3B + en;
+    h1 *= 0x9E37;
+    h1 ^= h1 >> 9;
+    h2 = (en ^ (en >> 8)) * 0x2F + nn;
+    h2 *= 0x6B43;
+    h2 ^= h2 >> 7;
+    return ((DWORD)h2 << 16) | h1;
 }
+
 /**
- * Initialise the RAM hash chain for reverse lookup of event to action. Uses the
- * data from the Flash Event2Action table.
+ * Add an event to the Bloom filter.
+ * @param nn the event NN
+ * @param en the event EN
  */
-void rebuildHashtable(void) {
-    // invalidate the current hash table
-    unsigned char hash;
-    unsigned char idx;
-    clearChainTable();
-    // now scan the event2Action table and populate the hash
-    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
-        hash = getHash(event2Action[idx].event.NN, event2Action[idx].event.EN);
-        unsigned char chainIdx;
-        for (chainIdx=0; chainIdx<CHAIN_LENGTH; chainIdx++) {
-            if (eventChains[hash][chainIdx] == NO_INDEX) {
-                // available
-                eventChains[hash][chainIdx] = idx;
-                break;
-            }
-        }
-    }
+void addBloomEntry(WORD nn, WORD en) {
+    DWORD h = getBloomHash(nn, en);
+    arraySetBit(eventBloomFilter, BLOOM_BIT1(h));
+    arraySetBit(eventBloomFilter, BLOOM_BIT2(h));
 }
 
 /**
- * Clear the RAM hash chain .
+ * Rebuild the Bloom filter from the event2Action table, dropping any events
+ * which have been unlearnt.
  */
-void clearChainTable(void) {
-    unsigned char h, chainIndex;
-    // First fill the entire chains with NO_INDEX
-    for (h=0; h<HASH_LENGTH; h++) {
-        for (chainIndex=0; chainIndex<CHAIN_LENGTH; chainIndex++) {
-            eventChains[h][chainIndex] = NO_INDEX;
+void rebuildBloomFilter(void) {
+    unsigned char idx;
+    for (idx=0; idx<sizeof(eventBloomFilter); idx++) {
+        eventBloomFilter[idx] = 0;
+    }
+    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
+        if ( ! EVENT_SLOT_EMPTY(idx)) {
+            addBloomEntry(eventKeys[idx].NN, eventKeys[idx].EN);
         }
     }
 }
+#endif
 
 
 /**
- * Get the Produced Event to transmit for the specified action.
- * @param action
- * @return the produced event or NULL if none has been provisioned
- */ 
-const Event * getProducedEvent(unsigned char action) {
-    if (action >= NUM_PRODUCER_ACTIONS)return NULL;    // not a produced valid action
-    const Event * ep = &action2Event[action];
+ * Clear all the actions' events.
+ */
+void clearAction2Event(void) {
+    fillFlashRange((BYTE*)action2Event, NO_EVENT, sizeof(action2Event));
+    flushFlashImage();
+#ifdef PRODUCED_EVENT_FRAMES
+    buildProducedEventFrames();
+#endif
+}
+
+void clearEvent2Action(void) {
+    // each table is cleared a whole Flash block at a time
+    fillFlashRange((BYTE*)eventKeys, NO_EVENT, sizeof(eventKeys));
+    fillFlashRange((BYTE*)eventActionRuns, NO_ACTION_RUN & 0xFF, sizeof(eventActionRuns));
+    fillFlashRange((BYTE*)eventActions, RUN_END, sizeof(eventActions));
+#ifdef NUM_EVENT_RANGES
+    fillFlashRange((BYTE*)eventRanges, NO_ACTION, sizeof(eventRanges));
+    eventRangesUsed = 0;
+#endif
+    flushFlashImage();
+#ifdef EVENT_CACHE_SIZE
+    clearEventCache();
+#endif
+#ifdef EVENT_STATE_CACHE
+    clearEventStates();
+#endif
+    rebuildEventSlots();
+#ifdef SHORT_EVENT_INDEX_SIZE
+    rebuildShortEventIndex();
+#endif
+    rebuildActionRuns();
+#ifdef ACTION_EVENT_MAP
+    rebuildActionEvents();
+#endif
+}
+
+#ifdef ACTION_EVENT_MAP
+/**
+ * Clear an event2Action slot from the bitmaps of all the actions.
+ * @param evtIdx the index into event2Action
+ */
+void clearEventActions(BYTE evtIdx) {
+    unsigned char action;
+    for (action=0; action<NUM_ACTIONS; action++) {
+        arrayClearBit(actionEvents[action], evtIdx);
+    }
+}
+
+/**
+ * Initialise the action to event bitmaps from the event2Action table in Flash.
+ */
+void rebuildActionEvents(void) {
+    unsigned char evtIdx, a, action;
+    for (action=0; action<NUM_ACTIONS; action++) {
+        for (a=0; a<sizeof(actionEvents[0]); a++) {
+            actionEvents[action][a] = 0;
+        }
+    }
+    for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+        if (EVENT_SLOT_EMPTY(evtIdx)) continue;
+        for (a=0; a<EVperEVT; a++) {
+            action = getEventAction(evtIdx, a);
+            if (action == NO_ACTION) break;
+            if (action < NUM_ACTIONS) {
+                arraySetBit(actionEvents[action], evtIdx);
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * Get one of an event's actions.
+ * @param evtIdx the index into event2Action
+ * @param a the position of the action in the event's run
+ * @return the action, or NO_ACTION if there isn't one
+ */
+BYTE getEventAction(BYTE evtIdx, BYTE a) {
+    if (EVENT_SLOT_EMPTY(evtIdx)) return NO_ACTION;     // the offset of an unused slot may be stale
+    WORD run = eventActionRuns[evtIdx];
+    if ((run == NO_ACTION_RUN) || (a >= RUN_LENGTH(eventActions[run]))) return NO_ACTION;
+    return eventActions[run+1+a];
+}
+
+/**
+ * Add an action to an event whose run has no spare space. The run is extended
+ * if it is the last one in the arena, otherwise its actions are copied to a new
+ * run one longer and the old run is abandoned.
+ * @param evtIdx the index into event2Action
+ * @param action the action to add
+ * @return TRUE if done, FALSE if there is no room left in the arena
+ */
+BOOL growActionRun(BYTE evtIdx, BYTE action) {
+    WORD run = eventActionRuns[evtIdx];
+    WORD newRun;
+    unsigned char a;
+    unsigned char len = 0;
+
+    if (run != NO_ACTION_RUN) {
+        len = RUN_LENGTH(eventActions[run]);
+        if ((run+1+len == eventActionsTop) && (eventActionsTop < EVENT_ACTION_ARENA)
+                && (RUN_PLACE(run, len+1) == run)) {
+            // last run in the arena so there is unused space after it in the same block
+            writeFlashImage((BYTE*)&(eventActions[run]), RUN_LIVE | (len+1));
+            writeFlashImage((BYTE*)&(eventActions[run+1+len]), action);
+            eventActionsTop++;
+            commitFlashImage();
+            return TRUE;
+        }
+    }
+    newRun = allocActionRun(len+1);
+    if (newRun == NO_ACTION_RUN) return FALSE;
+    run = eventActionRuns[evtIdx];   // may have been moved by compaction
+    for (a=0; a<len; a++) {
+        writeFlashImage((BYTE*)&(eventActions[newRun+1+a]), eventActions[run+1+a]);
+    }
+    writeFlashImage((BYTE*)&(eventActions[newRun+1+len]), action);
+    setFlashWord((WORD*)&(eventActionRuns[evtIdx]), newRun);
+    if (run != NO_ACTION_RUN) {
+        freeActionRun(run);
+    }
+    commitFlashImage();
+    return TRUE;
+}
+
+/**
+ * Allocate a run from the unused space at the end of the arena, compacting the
+ * arena first if there isn't enough. The actions in the new run are all NO_ACTION.
+ * @param length the number of actions in the run
+ * @return the offset of the run in eventActions, or NO_ACTION_RUN if there is no room
+ */
+WORD allocActionRun(BYTE length) {
+    WORD run = RUN_PLACE(eventActionsTop, length);
+    if ((run+1+length > EVENT_ACTION_ARENA) && (eventActionsAbandoned != 0)) {
+        compactActionRuns();
+        run = RUN_PLACE(eventActionsTop, length);
+    }
+    if (run+1+length > EVENT_ACTION_ARENA) return NO_ACTION_RUN;
+    padActionRuns(eventActionsTop, run);
+    writeFlashImage((BYTE*)&(eventActions[run]), RUN_LIVE | length);
+    eventActionsTop = run+1+length;
+    return run;
+}
+
+/**
+ * Fill the space skipped to keep a run within a Flash block with RUN_PAD.
+ * @param from the offset of the first byte skipped
+ * @param to the offset of the run
+ */
+void padActionRuns(WORD from, WORD to) {
+    for ( ; from<to; from++) {
+        writeFlashImage((BYTE*)&(eventActions[from]), RUN_PAD);
+    }
+}
+
+/**
+ * Abandon a run. Only clears RUN_LIVE so the length is still there to step over it.
+ * @param run the offset of the run in eventActions
+ */
+void freeActionRun(WORD run) {
+    BYTE len = RUN_LENGTH(eventActions[run]);
+    writeFlashImage((BYTE*)&(eventActions[run]), len);
+    eventActionsAbandoned += 1+len;
+}
+
+/**
+ * Remove the abandoned runs from the arena by moving the runs in use down over them.
+ * First each event is pointed at the new position of its run, then the runs are
+ * moved, so that each Flash block is only written once per pass.
+ */
+void compactActionRuns(void) {
+    unsigned char evtIdx, len;
+    WORD run, p, from, to;
+
+    flushFlashImage();
+    for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+        if (EVENT_SLOT_EMPTY(evtIdx)) continue;
+        run = eventActionRuns[evtIdx];
+        if (run == NO_ACTION_RUN) continue;
+        p = compactedActionRun(run);
+        if (p != run) {
+            setFlashWord((WORD*)&(eventActionRuns[evtIdx]), p);
+        }
+    }
+    // The runs only move down and are read from Flash before being overwritten
+    to = 0;
+    for (from=0; from<eventActionsTop; from+=1+len) {
+        len = RUN_LENGTH(eventActions[from]);
+        if (eventActions[from] & RUN_LIVE) {
+            p = RUN_PLACE(to, len);
+            padActionRuns(to, p);
+            to = p;
+            if (to != from) {
+                for (p=0; p<=len; p++) {
+                    writeFlashImage((BYTE*)&(eventActions[to+p]), eventActions[from+p]);
+                }
+            }
+            to += 1+len;
+        }
+    }
+    for (p=to; p<eventActionsTop; p++) {
+        writeFlashImage((BYTE*)&(eventActions[p]), RUN_END);
+    }
+    flushFlashImage();
+    eventActionsTop = to;
+    eventActionsAbandoned = 0;
+}
+
+/**
+ * Work out where compaction will move a run to, by laying out the runs in use
+ * before it again without the abandoned runs.
+ * @param run the offset of a run in use
+ * @return the offset of the run after compaction
+ */
+WORD compactedActionRun(WORD run) {
+    WORD from, to = 0;
+    unsigned char len;
+    for (from=0; ; from+=1+len) {
+        len = RUN_LENGTH(eventActions[from]);
+        if (eventActions[from] & RUN_LIVE) {
+            to = RUN_PLACE(to, len);
+            if (from == run) return to;
+            to += 1+len;
+        }
+    }
+}
+
+/**
+ * Find the unused space at the end of the arena and the amount abandoned.
+ */
+void rebuildActionRuns(void) {
+    WORD p = 0;
+    BYTE len;
+    eventActionsAbandoned = 0;
+    while ((p < EVENT_ACTION_ARENA) && (eventActions[p] != RUN_END)) {
+        len = RUN_LENGTH(eventActions[p]);
+        if ( ! (eventActions[p] & RUN_LIVE) && (eventActions[p] != RUN_PAD)) eventActionsAbandoned += 1+len;
+        p += 1+len;
+    }
+    eventActionsTop = (p > EVENT_ACTION_ARENA) ? EVENT_ACTION_ARENA : p;
+}
+
+/**
+ * Mark an event2Action slot as holding an event.
+ * @param evtIdx the index into event2Action
+ */
+void setEventSlotUsed(BYTE evtIdx) {
+    if (EVENT_SLOT_EMPTY(evtIdx)) {
+        arraySetBit(eventSlotsUsed, evtIdx);
+        eventSlotsUsedCount++;
+    }
+}
+
+/**
+ * Mark an event2Action slot as unused.
+ * @param evtIdx the index into event2Action
+ */
+void setEventSlotEmpty(BYTE evtIdx) {
+    if ( ! EVENT_SLOT_EMPTY(evtIdx)) {
+        arrayClearBit(eventSlotsUsed, evtIdx);
+        eventSlotsUsedCount--;
+    }
+}
+
+#ifdef EVENT_WEAR_LEVELLING
+/**
+ * Find the next unused event2Action slot without a tombstone, starting from
+ * eventSlotCursor. If only slots with tombstones are left they are reclaimed first.
+ * @return the index into event2Action, or NO_INDEX if the table is full
+ */
+BYTE findEmptyEventSlot(void) {
+    unsigned char i;
+    if (eventSlotsUsedCount >= NUM_CONSUMED_EVENTS) return NO_INDEX;
+    if (eventSlotsUsedCount + eventSlotsDeadCount >= NUM_CONSUMED_EVENTS) {
+        reclaimEventSlots();
+    }
+    i = eventSlotCursor;
+    while (( ! EVENT_SLOT_EMPTY(i)) || arrayTestBit(eventSlotsDead, i)) {
+        if (++i >= NUM_CONSUMED_EVENTS) i = 0;
+    }
+    eventSlotCursor = (i+1 < NUM_CONSUMED_EVENTS) ? i+1 : 0;
+    return i;
+}
+
+/**
+ * Erase the tombstones left by unlearnt events so that their slots can be used
+ * again. The keys are all done before the offsets so each block of eventKeys and
+ * eventActionRuns holding a tombstone is erased once.
+ */
+void reclaimEventSlots(void) {
+    unsigned char idx;
+    if (eventSlotsDeadCount == 0) return;
+    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
+        if (arrayTestBit(eventSlotsDead, idx)) {
+            setFlashWord((WORD*)&(eventKeys[idx].NN), NO_EVENT_WORD);
+            setFlashWord((WORD*)&(eventKeys[idx].EN), NO_EVENT_WORD);
+        }
+    }
+    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
+        if (arrayTestBit(eventSlotsDead, idx)) {
+            setFlashWord((WORD*)&(eventActionRuns[idx]), NO_ACTION_RUN);
+            arrayClearBit(eventSlotsDead, idx);
+        }
+    }
+    eventSlotsDeadCount = 0;
+    flushFlashImage();  // so the reclaimed slots can be read back from Flash
+}
+#else
+/**
+ * Find the first unused event2Action slot.
+ * @return the index into event2Action, or NO_INDEX if the table is full
+ */
+BYTE findEmptyEventSlot(void) {
+    unsigned char i, bit;
+    if (eventSlotsUsedCount >= NUM_CONSUMED_EVENTS) return NO_INDEX;
+    // there must be a clear bit and any spare bits at the end of the bitmap are clear
+    for (i=0; eventSlotsUsed[i] == 0xFF; i++)
+        ;
+    for (bit=0; eventSlotsUsed[i] & (1<<bit); bit++)
+        ;
+    return (i<<3) + bit;
+}
+#endif
+
+/**
+ * Initialise the bitmap of used event2Action slots from the table in Flash.
+ * With EVENT_WEAR_LEVELLING the slots with tombstones are found too, and the
+ * search for an unused slot carries on after the last slot that has been written.
+ */
+void rebuildEventSlots(void) {
+    unsigned char idx;
+    for (idx=0; idx<sizeof(eventSlotsUsed); idx++) {
+        eventSlotsUsed[idx] = 0;
+#ifdef EVENT_WEAR_LEVELLING
+        eventSlotsDead[idx] = 0;
+#endif
+    }
+    eventSlotsUsedCount = 0;
+#ifdef EVENT_WEAR_LEVELLING
+    eventSlotsDeadCount = 0;
+    eventSlotCursor = 0;
+#endif
+    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
+#ifdef EVENT_WEAR_LEVELLING
+        if (EVENT_KEY_TOMBSTONE(idx)) {
+            arraySetBit(eventSlotsDead, idx);
+            eventSlotsDeadCount++;
+            eventSlotCursor = idx+1;
+            continue;
+        }
+#endif
+        if ( ! EVENT_KEY_EMPTY(idx)) {
+            setEventSlotUsed(idx);
+#ifdef EVENT_WEAR_LEVELLING
+            eventSlotCursor = idx+1;
+#endif
+        }
+    }
+#ifdef EVENT_WEAR_LEVELLING
+    if (eventSlotCursor >= NUM_CONSUMED_EVENTS) eventSlotCursor = 0;
+#endif
+}
+#ifdef EVENT_SORTED_TABLE
+/**
+ * Nothing to do as the sorted event2Action table is its own index.
+ */
+void rebuildHashtable(void) {
+#ifdef EVENT_BLOOM_BITS
+    rebuildBloomFilter();
+#endif
+}
+
+void clearHashtable(void) {
+}
+
+#elif defined(EVENT_PERFECT_HASH)
+/**
+ * Bring the perfect hash up to date. During a learn session this is left until
+ * learn mode is released, see eventsEndLearn.
+ */
+void rebuildHashtable(void) {
+    invalidatePerfectHash();
+    if (flimState != fsFLiMLearn) {
+        buildPerfectHash();
+    }
+#ifdef EVENT_BLOOM_BITS
+    rebuildBloomFilter();
+#endif
+}
+
+void clearHashtable(void) {
+    invalidatePerfectHash();
+}
+
+#else
+/**
+ * Initialise the RAM hashtable for reverse lookup of event to action. Uses the
+ * data from the Flash Event2Action table.
+ */
+void rebuildHashtable(void) {
+    // invalidate the current hash table
+    unsigned char idx;
+    clearHashtable();
+    // now scan the event2Action table and populate the hash
+    for (idx=0; idx<NUM_CONSUMED_EVENTS; idx++) {
+        if ( ! EVENT_SLOT_EMPTY(idx)) {
+            addHashtableEntry(idx, getHash(eventKeys[idx].NN, eventKeys[idx].EN));
+        }
+    }
+#ifdef EVENT_BLOOM_BITS
+    rebuildBloomFilter();
+#endif
+}
+
+/**
+ * Clear the RAM hashtable.
+ */
+void clearHashtable(void) {
+    WORD h;
+    // Fill the entire table with NO_INDEX
+    for (h=0; h<EVENT_HASH_LENGTH; h++) {
+        eventHashtable[h] = NO_INDEX;
+    }
+    eventHashMaxProbe = 0;
+}
+#endif
+
+
+/**
+ * Get the Produced Event to transmit for the specified action.
+ * @param action
+ * @return the produced event or NULL if none has been provisioned, or it has been unlearnt
+ */ 
+const Event * getProducedEvent(unsigned char action) {
+#ifdef FLASH_DEFERRED_FLUSH
+    static Event producedEvent;     // copied out of the Flash image, which may hold a new event
+#endif
+    if (action >= NUM_PRODUCER_ACTIONS)return NULL;    // not a produced valid action
+#ifdef FLASH_DEFERRED_FLUSH
+    producedEvent.NN = FLASH_READ_WORD(&action2Event[action].NN);
+    producedEvent.EN = FLASH_READ_WORD(&action2Event[action].EN);
+    const Event * ep = &producedEvent;
+#else
+    const Event * ep = &action2Event[action];
+#endif
     if ((ep->EN == 0) && (ep->NN == 0)) return NULL;    // not provisioned
+    if ((ep->EN == NO_EVENT_WORD) && (ep->NN == NO_EVENT_WORD)) return NULL;   // erased or unlearnt
     return ep; 
 }
 
+/**
+ * Send the Produced Event of the specified action.
+ * @param action
+ * @param on TRUE to send the ON event, FALSE for the OFF event
+ * @return TRUE if the event was sent, FALSE if none has been provisioned or it could not be queued
+ */
+BOOL sendProducedEvent(unsigned char action, BOOL on) {
+#ifdef PRODUCED_EVENT_FRAMES
+    if (action >= NUM_PRODUCER_ACTIONS) return FALSE;   // not a produced valid action
+    if ((producedFramesCanId != canID) || (producedFramesNodeID != nodeID)) {
+        buildProducedEventFrames();
+    }
+    CanPacket * frame = &producedEventFrames[action][on ? 0 : 1];
+    if (frame->buffer[dlc] == 0) return FALSE;          // not provisioned
+    return cbusSendEventFrame(frame);
+#else
+    const Event * ep = getProducedEvent(action);
+    if (ep == NULL) return FALSE;
+    cbusSendEvent(0, ep->NN, ep->EN, on);
+    return TRUE;
+#endif
+}
+
+#ifdef PRODUCED_EVENT_FRAMES
+/**
+ * Encode the ON and OFF frames of all the produced actions from the action2Event
+ * table. Short events are sent with our node number, as cbusSendEvent() does.
+ */
+void buildProducedEventFrames(void) {
+    unsigned char action;
+    for (action=0; action<NUM_PRODUCER_ACTIONS; action++) {
+        const Event * ep = getProducedEvent(action);
+        unsigned char i;
+        for (i=0; i<2; i++) {
+            CanPacket * frame = &producedEventFrames[action][i];
+            if (ep == NULL) {
+                frame->buffer[dlc] = 0;
+                continue;
+            }
+            frame->buffer[d0] = OPC_ACON | i;       // second frame is the OFF event
+            if (ep->NN == 0) {
+                frame->buffer[d0] |= 0x08;          // short event opcode
+                frame->buffer[d1] = nodeID>>8;
+                frame->buffer[d2] = nodeID & 0xFF;
+            } else {
+                frame->buffer[d1] = ep->NN>>8;
+                frame->buffer[d2] = ep->NN & 0xFF;
+            }
+            frame->buffer[d3] = ep->EN>>8;
+            frame->buffer[d4] = ep->EN & 0xFF;
+            frame->buffer[eidh] = 0;
+            frame->buffer[eidl] = 0;
+            frame->buffer[dlc] = 5;
+            canSetHeader(frame);
+        }
+    }
+    producedFramesCanId = canID;
+    producedFramesNodeID = nodeID;
+}
+#endif
+
 
 /**
  * Perform the actions associated with this consumed event. 
@@ -470,28 +1871,469 @@ const Event * getProducedEvent(unsigned char action) {
  * @return true if the action was processed
  */
 BOOL doActions(const Event * e, BYTE* msg) {
-    unsigned char hash = getHash(e->NN, e->EN);
-    unsigned char chainIdx;
+    unsigned char evtIdx = lookupConsumedEvent(e->NN, e->EN);
     BOOL processed = FALSE;
-    for (chainIdx=0; chainIdx<CHAIN_LENGTH; chainIdx++) {
-        unsigned char evtIdx = eventChains[hash][chainIdx];
-        if (evtIdx == NO_INDEX) return processed;    // no more left to check - no action
-        // need to check in case of hash collision
-        const Event * otherEvent = (const Event*)&(event2Action[evtIdx].event);
-        if ((e->EN == otherEvent->EN) && (e->NN == otherEvent->NN)) {
-            // found the correct consumed event - now process the actions
-            unsigned char action;
-            for (action=0; action<EVperEVT; action++) {
-                if (action == NO_ACTION) return processed;    // done all the actions
-                processEvent(action, msg);      // found it
-                processed = TRUE;
-            }
+    if (evtIdx == NO_INDEX) return processed;    // not a consumed event - no action
+#ifdef EVENT_STATE_CACHE
+    BOOL repeat = updateEventState(evtIdx, msg[d0]);
+#endif
+    // found the correct consumed event - now process the actions
+    WORD run = FLASH_READ_WORD(&eventActionRuns[evtIdx]);
+    if (run == NO_ACTION_RUN) return processed;
+    unsigned char len = RUN_LENGTH(FLASH_READ_BYTE(&eventActions[run]));
+    unsigned char a;
+#ifdef EVENT_PROCESS_ACTIONS
+#ifdef FLASH_DEFERRED_FLUSH
+    // processActions() reads the actions directly so they are copied out of the Flash image
+    BYTE actions[EVperEVT];
+    for (a=0; a<len; a++) {
+        actions[a] = FLASH_READ_BYTE(&eventActions[run+1+a]);
+    }
+#else
+    const BYTE * actions = &eventActions[run+1];
+#endif
+    // the unused actions are at the end of the run
+    for (a=0; a<len; a++) {
+        if (actions[a] == NO_ACTION) break;
+    }
+    if (a == 0) return processed;
+#ifdef EVENT_STATE_CACHE
+    // a repeat is only skipped if all of the actions allow it
+    if (repeat) {
+        for (len=0; len<a; len++) {
+            if ( ! EVENT_REPEAT_SUPPRESSED(actions[len])) break;
         }
+        if (len == a) return TRUE;
+    }
+#endif
+    processActions(actions, a, IS_ON_EVENT_OPC(msg[d0]), EVENT_DATA_LENGTH(msg[d0]), msg);
+    processed = TRUE;
+#else
+    for (a=0; a<len; a++) {
+        unsigned char action = FLASH_READ_BYTE(&eventActions[run+1+a]);
+        if (action == NO_ACTION) return processed;    // done all the actions
+        processed = TRUE;
+#ifdef EVENT_STATE_CACHE
+        if (repeat && EVENT_REPEAT_SUPPRESSED(action)) continue;
+#endif
+        processEvent(action, msg);
     }
+#endif
     return processed;
 }
 
+/**
+ * Find a consumed event in the event2Action table, trying the short event index and
+ * the cache of recently used events before the full lookup.
+ * @param nn the event NN, 0 for a short event
+ * @param en the event EN
+ * @return the index into event2Action or NO_INDEX if not a consumed event
+ */
+BYTE lookupConsumedEvent(WORD nn, WORD en) {
+#if defined(SHORT_EVENT_INDEX_SIZE) || defined(EVENT_CACHE_SIZE)
+    unsigned char evtIdx;
+#endif
+#ifdef SHORT_EVENT_INDEX_SIZE
+    if (nn == 0) {
+        evtIdx = findShortEvent(en);
+        if (evtIdx != NO_INDEX) return evtIdx;
+    }
+#endif
+#ifdef EVENT_CACHE_SIZE
+    evtIdx = findCachedEvent(nn, en);
+    if (evtIdx != NO_INDEX) return evtIdx;
+    evtIdx = findEvent(nn, en, FALSE);
+    if (evtIdx != NO_INDEX) {
+        addCachedEvent(nn, en, evtIdx);
+    }
+    return evtIdx;
+#else
+    return findEvent(nn, en, FALSE);
+#endif
+}
+
+#ifdef EVENT_STATE_CACHE
+/**
+ * Record the state of a consumed event which has been received.
+ * @param evtIdx the index into event2Action
+ * @param opc the event opcode
+ * @return TRUE if the event has no data and is in the state it was already in
+ */
+BOOL updateEventState(BYTE evtIdx, BYTE opc) {
+    BOOL on = IS_ON_EVENT_OPC(opc);
+    BOOL repeat = arrayTestBit(eventStateKnown, evtIdx) && ((arrayTestBit(eventStateOn, evtIdx) != 0) == on);
+    arraySetBit(eventStateKnown, evtIdx);
+    if (on) {
+        arraySetBit(eventStateOn, evtIdx);
+    } else {
+        arrayClearBit(eventStateOn, evtIdx);
+    }
+    if (EVENT_DATA_LENGTH(opc) != 0) return FALSE;
+    if (repeat) eventRepeats++;
+    return repeat;
+}
+
+/**
+ * Forget the state of an event2Action slot.
+ * @param evtIdx the index into event2Action
+ */
+void clearEventState(BYTE evtIdx) {
+    arrayClearBit(eventStateKnown, evtIdx);
+    arrayClearBit(eventStateOn, evtIdx);
+}
+
+/**
+ * Forget the states of all the consumed events.
+ */
+void clearEventStates(void) {
+    unsigned char i;
+    for (i=0; i<sizeof(eventStateKnown); i++) {
+        eventStateKnown[i] = 0;
+    }
+}
+
+/**
+ * Answer an AREQ or ASRQ for a consumed event with the last state received,
+ * with ARON/AROF or ARSON/ARSOF. The reply carries this node's number so only
+ * requests addressed to this node, or an ASRQ with NN 0, are answered. Nothing
+ * is sent if the state isn't known.
+ * @param msg the request
+ * @return TRUE if answered
+ */
+BOOL parseCbusEventRequest(BYTE * msg) {
+    BOOL shortEvent = IS_SHORT_EVENT_OPC(msg[d0]);
+    WORD nn = (msg[d1] << 8) + msg[d2];
+    WORD en = (msg[d3] << 8) + msg[d4];
+    unsigned char evtIdx;
+    if ((nn != nodeID) && ! (shortEvent && (nn == 0))) return FALSE;
+    if (shortEvent) {
+        // as in parseCbusEvent, try NN 0 then the form taught with a node number
+        evtIdx = lookupConsumedEvent(0, en);
+        if ((evtIdx == NO_INDEX) && (nn != 0)) {
+            evtIdx = lookupConsumedEvent(nn, en);
+        }
+    } else {
+        evtIdx = lookupConsumedEvent(nn, en);
+    }
+    if ((evtIdx == NO_INDEX) || ! arrayTestBit(eventStateKnown, evtIdx)) return FALSE;
+    cbusMsg[d3] = msg[d3];
+    cbusMsg[d4] = msg[d4];
+    if (shortEvent) {
+        cbusSendOpcMyNN(0, arrayTestBit(eventStateOn, evtIdx) ? OPC_ARSON : OPC_ARSOF, cbusMsg);
+    } else {
+        cbusSendOpcMyNN(0, arrayTestBit(eventStateOn, evtIdx) ? OPC_ARON : OPC_AROF, cbusMsg);
+    }
+    return TRUE;
+}
+#endif
+
+
+
+#ifdef SHORT_EVENT_INDEX_SIZE
+/**
+ * Look for a short event in the short event index.
+ * @param en the device number
+ * @return the index into event2Action or NO_INDEX if not indexed
+ */
+BYTE findShortEvent(WORD en) {
+    BYTE evtIdx = shortEventIndex[SHORT_EVENT_ENTRY(en)];
+    if ((evtIdx != NO_INDEX) && (FLASH_READ_WORD(&eventKeys[evtIdx].EN) == en) && (FLASH_READ_WORD(&eventKeys[evtIdx].NN) == 0)) {
+        return evtIdx;
+    }
+    return NO_INDEX;
+}
+
+/**
+ * Index a short event, unless another short event already has the entry.
+ * @param evtIdx the index into event2Action
+ * @param en the device number
+ */
+void addShortEvent(BYTE evtIdx, WORD en) {
+    if (shortEventIndex[SHORT_EVENT_ENTRY(en)] == NO_INDEX) {
+        shortEventIndex[SHORT_EVENT_ENTRY(en)] = evtIdx;
+    }
+}
 
+/**
+ * Remove an event from the short event index, indexing another short event
+ * sharing the entry if there is one. Must be called before the event is removed
+ * from Flash.
+ * @param evtIdx the index into event2Action
+ */
+void removeShortEvent(BYTE evtIdx) {
+    unsigned char entry, i;
+    if (eventKeys[evtIdx].NN != 0) return;
+    entry = SHORT_EVENT_ENTRY(eventKeys[evtIdx].EN);
+    if (shortEventIndex[entry] != evtIdx) return;
+    shortEventIndex[entry] = NO_INDEX;
+    for (i=0; i<NUM_CONSUMED_EVENTS; i++) {
+        if ((i != evtIdx) && ! EVENT_SLOT_EMPTY(i) && (eventKeys[i].NN == 0)
+                && (SHORT_EVENT_ENTRY(eventKeys[i].EN) == entry)) {
+            shortEventIndex[entry] = i;
+            return;
+        }
+    }
+}
+
+/**
+ * Index all the short events in the event2Action table.
+ */
+void rebuildShortEventIndex(void) {
+    unsigned char i;
+    for (i=0; i<SHORT_EVENT_INDEX_SIZE; i++) {
+        shortEventIndex[i] = NO_INDEX;
+    }
+    for (i=0; i<NUM_CONSUMED_EVENTS; i++) {
+        if ( ! EVENT_SLOT_EMPTY(i) && (eventKeys[i].NN == 0)) {
+            addShortEvent(i, eventKeys[i].EN);
+        }
+    }
+}
+#endif
+
+#ifdef NUM_EVENT_RANGES
+/**
+ * Teach a consumed event range whilst in learn mode. Every event number from enLo to
+ * enHi from the node is consumed, the first giving the action and the others either
+ * the same action or the following ones. Ranges from the same node must not overlap,
+ * but may overlap ranges from any node and ordinary consumed events, in which case the
+ * actions of each are performed.
+ * @param nodeNumber the node, or EVENT_RANGE_ANY_NN to match events from any node
+ * @param enLo the first event number
+ * @param enHi the last event number
+ * @param action the action of the first event
+ * @param actionStep 0 for every event to have the action, 1 for consecutive actions
+ */
+void doEvlrnRange(WORD nodeNumber, WORD enLo, WORD enHi, BYTE action, BYTE actionStep) {
+    unsigned char idx, i;
+    if ((enHi < enLo) || (actionStep > 1) || (action < NUM_PRODUCER_ACTIONS) || (action >= NUM_ACTIONS)
+            || (actionStep && (enHi - enLo >= NUM_ACTIONS - action))) {
+        cbusMsg[d3] = CMDERR_INV_EV_VALUE;
+        cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+        return;
+    }
+    // check it doesn't overlap the ranges either side of where it goes
+    idx = findEventRange(nodeNumber, enLo);
+    if (idx != NO_INDEX) {
+        if ((eventRanges[idx].enLo == enLo) && (eventRanges[idx].enHi == enHi)
+                && (eventRanges[idx].action == action) && (eventRanges[idx].actionStep == actionStep)) {
+            // already taught
+            cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
+            return;
+        }
+        cbusMsg[d3] = CMDERR_INVALID_EVENT;
+        cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+        return;
+    }
+    for (idx=0; idx<eventRangesUsed; idx++) {
+        if ((eventRanges[idx].NN > nodeNumber) ||
+                ((eventRanges[idx].NN == nodeNumber) && (eventRanges[idx].enLo > enLo))) break;
+    }
+    if ((idx < eventRangesUsed) && (eventRanges[idx].NN == nodeNumber) && (eventRanges[idx].enLo <= enHi)) {
+        cbusMsg[d3] = CMDERR_INVALID_EVENT;
+        cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+        return;
+    }
+    if (eventRangesUsed >= NUM_EVENT_RANGES) {
+        cbusMsg[d3] = CMDERR_TOO_MANY_EVENTS;
+        cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+        return;
+    }
+    // make room by moving the following ranges up one, starting from the end
+    for (i=eventRangesUsed; i>idx; i--) {
+        writeEventRange(i, eventRanges[i-1].NN, eventRanges[i-1].enLo, eventRanges[i-1].enHi,
+                eventRanges[i-1].action, eventRanges[i-1].actionStep);
+    }
+    writeEventRange(idx, nodeNumber, enLo, enHi, action, actionStep);
+    commitFlashImage();
+    rebuildEventRanges();
+    cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
+}
+
+/**
+ * Unlearn a consumed event range.
+ * @param nodeNumber the node, or EVENT_RANGE_ANY_NN
+ * @param enLo the first event number of the range
+ */
+void doEvulnRange(WORD nodeNumber, WORD enLo) {
+    unsigned char idx = findEventRange(nodeNumber, enLo);
+    if ((idx == NO_INDEX) || (eventRanges[idx].enLo != enLo)) {
+        cbusMsg[d3] = CMDERR_INVALID_EVENT;
+        cbusSendOpcMyNN( 0, OPC_CMDERR, cbusMsg);
+        return;
+    }
+    removeEventRange(idx);
+    cbusSendOpcMyNN( 0, OPC_WRACK, cbusMsg);
+}
+
+/**
+ * Find the range holding an event from a node using a binary search.
+ * Ranges for any node are only found if nn is EVENT_RANGE_ANY_NN.
+ * @param nn the event NN
+ * @param en the event EN
+ * @return the index into eventRanges, or NO_INDEX if in none
+ */
+BYTE findEventRange(WORD nn, WORD en) {
+    unsigned char lo = 0;
+    unsigned char hi = eventRangesUsed;
+    unsigned char mid;
+    // find the first range which starts after the event
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        WORD rangeNN = FLASH_READ_WORD(&eventRanges[mid].NN);
+        if ((rangeNN < nn) || ((rangeNN == nn) && (FLASH_READ_WORD(&eventRanges[mid].enLo) <= en))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ((lo > 0) && (FLASH_READ_WORD(&eventRanges[lo-1].NN) == nn) && (en <= FLASH_READ_WORD(&eventRanges[lo-1].enHi))) {
+        return lo-1;
+    }
+    return NO_INDEX;
+}
+
+/**
+ * Perform the actions of the ranges holding an event, from its node and from any node.
+ * @param e the event
+ * @param msg the received message
+ * @return true if an action was processed
+ */
+BOOL doRangeActions(const Event * e, BYTE * msg) {
+    BOOL processed = FALSE;
+    BYTE action;
+    unsigned char idx;
+    if ((eventRangesUsed == 0) || (e->EN < eventRangesLoEN) || (e->EN > eventRangesHiEN)) {
+        return FALSE;
+    }
+    idx = findEventRange(e->NN, e->EN);
+    if (idx != NO_INDEX) {
+        action = FLASH_READ_BYTE(&eventRanges[idx].action)
+                + FLASH_READ_BYTE(&eventRanges[idx].actionStep)*(e->EN - FLASH_READ_WORD(&eventRanges[idx].enLo));
+#ifdef EVENT_PROCESS_ACTIONS
+        processActions(&action, 1, IS_ON_EVENT_OPC(msg[d0]), EVENT_DATA_LENGTH(msg[d0]), msg);
+#else
+        processEvent(action, msg);
+#endif
+        processed = TRUE;
+    }
+    if (e->NN != EVENT_RANGE_ANY_NN) {
+        idx = findEventRange(EVENT_RANGE_ANY_NN, e->EN);
+        if (idx != NO_INDEX) {
+            action = FLASH_READ_BYTE(&eventRanges[idx].action)
+                    + FLASH_READ_BYTE(&eventRanges[idx].actionStep)*(e->EN - FLASH_READ_WORD(&eventRanges[idx].enLo));
+#ifdef EVENT_PROCESS_ACTIONS
+            processActions(&action, 1, IS_ON_EVENT_OPC(msg[d0]), EVENT_DATA_LENGTH(msg[d0]), msg);
+#else
+            processEvent(action, msg);
+#endif
+            processed = TRUE;
+        }
+    }
+    return processed;
+}
+
+/**
+ * Write a range to an entry of eventRanges. The caller must flush the Flash image afterwards.
+ * @param idx the index into eventRanges
+ */
+void writeEventRange(BYTE idx, WORD nn, WORD enLo, WORD enHi, BYTE action, BYTE actionStep) {
+    setFlashWord((WORD*)&(eventRanges[idx].NN), nn);
+    setFlashWord((WORD*)&(eventRanges[idx].enLo), enLo);
+    setFlashWord((WORD*)&(eventRanges[idx].enHi), enHi);
+    writeFlashImage((BYTE*)&(eventRanges[idx].action), action);
+    writeFlashImage((BYTE*)&(eventRanges[idx].actionStep), actionStep);
+}
+
+/**
+ * Remove a range, moving the following ranges down one. The ranges are read through
+ * the Flash cache as a previous removal may not have been written yet.
+ * @param idx the index into eventRanges
+ */
+void removeEventRange(BYTE idx) {
+    for ( ; idx+1<eventRangesUsed; idx++) {
+        writeEventRange(idx, FLASH_READ_WORD(&eventRanges[idx+1].NN), FLASH_READ_WORD(&eventRanges[idx+1].enLo),
+                FLASH_READ_WORD(&eventRanges[idx+1].enHi), FLASH_READ_BYTE(&eventRanges[idx+1].action),
+                FLASH_READ_BYTE(&eventRanges[idx+1].actionStep));
+    }
+    writeEventRange(idx, NO_EVENT_WORD, NO_EVENT_WORD, NO_EVENT_WORD, NO_ACTION, NO_ACTION);
+    commitFlashImage();
+    rebuildEventRanges();
+}
+
+/**
+ * Count the ranges in use and find the span of event numbers they cover.
+ */
+void rebuildEventRanges(void) {
+    WORD en;
+    eventRangesUsed = 0;
+    eventRangesLoEN = 0xffff;
+    eventRangesHiEN = 0;
+    while ((eventRangesUsed < NUM_EVENT_RANGES) && (FLASH_READ_BYTE(&eventRanges[eventRangesUsed].action) != NO_ACTION)) {
+        en = FLASH_READ_WORD(&eventRanges[eventRangesUsed].enLo);
+        if (en < eventRangesLoEN) eventRangesLoEN = en;
+        en = FLASH_READ_WORD(&eventRanges[eventRangesUsed].enHi);
+        if (en > eventRangesHiEN) eventRangesHiEN = en;
+        eventRangesUsed++;
+    }
+}
+#endif
+
+#ifdef EVENT_CACHE_SIZE
+/**
+ * Look for an event in the cache, moving it to the front if found.
+ * @param nn the event NN
+ * @param en the event EN
+ * @return the index into event2Action or NO_INDEX if not cached
+ */
+BYTE findCachedEvent(WORD nn, WORD en) {
+    unsigned char i;
+    BYTE evtIdx;
+    for (i=0; i<EVENT_CACHE_SIZE; i++) {
+        if (eventCache[i].evtIdx == NO_INDEX) break;     // the used entries are at the front
+        if ((eventCache[i].event.EN == en) && (eventCache[i].event.NN == nn)) {
+            evtIdx = eventCache[i].evtIdx;
+            // move it to the front
+            for ( ; i>0; i--) {
+                eventCache[i] = eventCache[i-1];
+            }
+            eventCache[0].event.NN = nn;
+            eventCache[0].event.EN = en;
+            eventCache[0].evtIdx = evtIdx;
+            eventCacheHits++;
+            return evtIdx;
+        }
+    }
+    eventCacheMisses++;
+    return NO_INDEX;
+}
+
+/**
+ * Add an event to the front of the cache, dropping the least recently used one.
+ * @param nn the event NN
+ * @param en the event EN
+ * @param evtIdx the index into event2Action
+ */
+void addCachedEvent(WORD nn, WORD en, BYTE evtIdx) {
+    unsigned char i;
+    for (i=EVENT_CACHE_SIZE-1; i>0; i--) {
+        eventCache[i] = eventCache[i-1];
+    }
+    eventCache[0].event.NN = nn;
+    eventCache[0].event.EN = en;
+    eventCache[0].evtIdx = evtIdx;
+}
+
+/**
+ * Empty the cache.
+ */
+void clearEventCache(void) {
+    unsigned char i;
+    for (i=0; i<EVENT_CACHE_SIZE; i++) {
+        eventCache[i].evtIdx = NO_INDEX;
+    }
+}
+#endif
 
 /**
  * Delete an action.
@@ -500,33 +2342,87 @@ BOOL doActions(const Event * e, BYTE* msg) {
 void deleteAction(unsigned char action) {
     // need to delete this action from the Produced and Consumed tables
     // delete from produced first
-    writeFlashImage((BYTE*)&(action2Event[action].NN), NO_EVENT);
-    writeFlashImage((BYTE*)&(action2Event[action].NN)+1, NO_EVENT);
-    writeFlashImage((BYTE*)&(action2Event[action].EN), NO_EVENT);
-    writeFlashImage((BYTE*)&(action2Event[action].EN)+1, NO_EVENT);
+    if (action < NUM_PRODUCER_ACTIONS) {
+        writeFlashImage((BYTE*)&(action2Event[action].NN), NO_EVENT);
+        writeFlashImage((BYTE*)&(action2Event[action].NN)+1, NO_EVENT);
+        writeFlashImage((BYTE*)&(action2Event[action].EN), NO_EVENT);
+        writeFlashImage((BYTE*)&(action2Event[action].EN)+1, NO_EVENT);
+    }
     
     // now delete from consumed
-    unsigned char evtIdx;
-    for (evtIdx=0; evtIdx<NUM_CONSUMED_EVENTS; evtIdx++) {
+    unsigned char evtIdx = 0;
+#ifdef ACTION_EVENT_MAP
+    if (action >= NUM_ACTIONS) evtIdx = NUM_CONSUMED_EVENTS;   // can't have been taught
+#endif
+    while (evtIdx<NUM_CONSUMED_EVENTS) {
         unsigned char a;
-        for (a=0; a<EVperEVT; a++) {
-            if (event2Action[evtIdx].actions[a] == action) {
-                // shift the actions along - could be made more efficient by checking if we have reached a NO_ACTIO
-                for (unsigned char aa = a; aa <EVperEVT-1; aa++) {
-                    writeFlashImage((BYTE*)&(event2Action[evtIdx].actions[aa]), event2Action[evtIdx].actions[aa+1]);
+#ifdef ACTION_EVENT_MAP
+        // only look at the events which use this action
+        if (actionEvents[action][evtIdx>>3] == 0) {
+            evtIdx |= 7;            // skip to the next byte of the bitmap
+            if (evtIdx >= NUM_CONSUMED_EVENTS) break;
+            evtIdx++;
+            continue;
+        }
+        if ( ! arrayTestBit(actionEvents[action], evtIdx)) {
+            evtIdx++;
+            continue;
+        }
+#endif
+        if (EVENT_SLOT_EMPTY(evtIdx)) {
+            evtIdx++;
+            continue;
+        }
+        WORD run = eventActionRuns[evtIdx];
+        unsigned char len = (run == NO_ACTION_RUN) ? 0 : RUN_LENGTH(eventActions[run]);
+        for (a=0; a<len; a++) {
+            if (eventActions[run+1+a] == action) break;
+        }
+        if (a < len) {
+            // if this is the only action then delete the entry entirely
+            if ((a == 0) && ((len == 1) || (eventActions[run+2] == NO_ACTION))) {
+                removeEvent(evtIdx);
+#ifdef EVENT_SORTED_TABLE
+                flushFlashImage();  // the following events have moved down so check this slot again
+                continue;
+#endif
+            } else {
+                // shift the remaining actions along
+                for ( ; a<len-1; a++) {
+                    writeFlashImage((BYTE*)&(eventActions[run+1+a]), eventActions[run+2+a]);
                 }
-                writeFlashImage((BYTE*)&(event2Action[evtIdx].actions[EVperEVT-1]), NO_ACTION);
+                writeFlashImage((BYTE*)&(eventActions[run+len]), NO_ACTION);
+#ifdef ACTION_EVENT_MAP
+                arrayClearBit(actionEvents[action], evtIdx);
+#endif
             }
         }
-        // if the first (and hence all actions) is NO_ACTION then delete the entry entirely
-        if (event2Action[evtIdx].actions[0] == NO_ACTION) {
-            setFlashWord((WORD*)&event2Action[evtIdx].event.NN, NO_EVENT);
-            setFlashWord((WORD*)&event2Action[evtIdx].event.EN, NO_EVENT);
-        }
+        evtIdx++;
     }
     flushFlashImage();
-    // easier to rebuild from scratch
-    rebuildHashtable();
+#ifdef PRODUCED_EVENT_FRAMES
+    if (action < NUM_PRODUCER_ACTIONS) {
+        buildProducedEventFrames();
+    }
+#endif
+#ifdef NUM_EVENT_RANGES
+    // and the ranges using this action
+    evtIdx = 0;
+    while (evtIdx < eventRangesUsed) {
+        BYTE base = FLASH_READ_BYTE(&eventRanges[evtIdx].action);
+        if ((action == base) || ((FLASH_READ_BYTE(&eventRanges[evtIdx].actionStep) != 0) && (action > base)
+                && (action - base <= FLASH_READ_WORD(&eventRanges[evtIdx].enHi) - FLASH_READ_WORD(&eventRanges[evtIdx].enLo)))) {
+            removeEventRange(evtIdx);
+        } else {
+            evtIdx++;
+        }
+    }
+#endif
+#ifdef EVENT_PERFECT_HASH
+    if (flimState != fsFLiMLearn) {
+        eventsEndLearn();
+    }
+#endif
 }
 
 
@@ -54,6 +54,9 @@ events.h - Definitions for CBUS event handling module - Part of CBUS libraries f
 //    An event opcode has bits 4 and 7 set, bits 1 and 2 clear
 //    An ON event opcode also has bit 0 clear
 //    An OFF event opcode also has bit 0 set
+//    A short event opcode also has bit 3 set, the event is then just the device number
+//    in d3/d4 and is held with NN 0 as d1/d2 are the node number of the sender.
+//    Short events taught with the sender's node number, as they were before, still match
 //
 //  eg:
 //  ACON/ACOF  90/91    1001  0000/0001
@@ -69,21 +72,71 @@ events.h - Definitions for CBUS event handling module - Part of CBUS libraries f
 #define NO_ACTION   0xff
 #define NO_INDEX    0xff
 #define NO_EVENT    0xff
+#define NO_EVENT_WORD   0xffff      // NN and EN of an unused event2Action slot
+#define EVENT_RANGE_ANY_NN  0xffff  // NN of an event range which matches events from any node
+
+// Values for EVENT_HASH_FUNCTION in module.h
+#define EVENT_HASH_XOR          1   // XOR of the bytes of the NN and EN
+#define EVENT_HASH_MULTIPLY     2   // multiplicative hash of the NN and EN combined
+#define EVENT_HASH_MODULE       3   // moduleEventHash() supplied by the module
 
 #define     EVENT_SET_MASK  0b10010000
 #define     EVENT_CLR_MASK  0b00000110
 #define     EVENT_ON_MASK   0b00000001
+#define     EVENT_SHORT_MASK 0b00001000
+
+#define     IS_EVENT_OPC(opc)   ((((opc) & EVENT_SET_MASK) == EVENT_SET_MASK) && (((opc) & EVENT_CLR_MASK) == 0))
+#define     IS_SHORT_EVENT_OPC(opc) (((opc) & EVENT_SHORT_MASK) == EVENT_SHORT_MASK)
+// Response events report the state of an event and are consumed like the event itself,
+// but their ON and OFF opcodes don't follow EVENT_ON_MASK
+#define     IS_ON_RESPONSE_OPC(opc) ((opc)==OPC_ARON || (opc)==OPC_ARSON || (opc)==OPC_ARON1 || (opc)==OPC_ARSON1 || \
+                                     (opc)==OPC_ARON2 || (opc)==OPC_ARSON2 || (opc)==OPC_ARON3 || (opc)==OPC_ARSON3)
+#define     IS_OFF_RESPONSE_OPC(opc) ((opc)==OPC_AROF || (opc)==OPC_ARSOF || (opc)==OPC_AROF1 || (opc)==OPC_ARSOF1 || \
+                                     (opc)==OPC_AROF2 || (opc)==OPC_ARSOF2 || (opc)==OPC_AROF3 || (opc)==OPC_ARSOF3)
+#define     IS_RESPONSE_EVENT_OPC(opc)  (IS_ON_RESPONSE_OPC(opc) || IS_OFF_RESPONSE_OPC(opc))
+#define     IS_ON_EVENT_OPC(opc)    (IS_ON_RESPONSE_OPC(opc) || ((((opc) & EVENT_ON_MASK) == 0) && ! IS_OFF_RESPONSE_OPC(opc)))
+#define     EVENT_DATA_LENGTH(opc)  (((opc) >> 5) - 4)     // data bytes after the event, 0 to 3
 
 // Function prototypes for event management
 
 //void 	eventsInit( void );
 extern void clearAllEvents(void);
 extern void clearAction2Event(void);
-extern void clearChainTable(void);
+extern void clearHashtable(void);
 extern void eventsInit(void);
+extern void eventsEndLearn(void);
 extern const Event * getProducedEvent(unsigned char action);
+extern BOOL sendProducedEvent(unsigned char action, BOOL on);
 extern BOOL doActions(const Event * e, BYTE * msg);
+// results of doConsumedEvent, combined with | across the lookups of one event
+#define EVENT_FILTERED      0
+#define EVENT_NOT_CONSUMED  1
+#define EVENT_CONSUMED      3
+extern BYTE doConsumedEvent(const Event * e, BYTE * msg);
+#ifdef EVENT_BLOOM_BITS
+extern WORD eventBloomHits;
+extern WORD eventBloomMisses;
+extern WORD eventBloomFalsePositives;
+#endif
+#ifdef EVENT_PERFECT_HASH
+extern WORD perfectHashFailures;
+#endif
+#if !defined(EVENT_SORTED_TABLE) && !defined(EVENT_PERFECT_HASH)
+extern BYTE eventHashMaxProbe;
+extern WORD eventHashDisplacements;
+#endif
+#ifdef EVENT_STATE_CACHE
+extern WORD eventRepeats;
+#endif
+#ifdef EVENT_CACHE_SIZE
+extern WORD eventCacheHits;
+extern WORD eventCacheMisses;
+#endif
 extern void doEvlrn(WORD nodeNumber, WORD eventNumber, BYTE evNum, BYTE evVal);
+#ifdef NUM_EVENT_RANGES
+extern void doEvlrnRange(WORD nodeNumber, WORD enLo, WORD enHi, BYTE action, BYTE actionStep);
+extern void doEvulnRange(WORD nodeNumber, WORD enLo);
+#endif
 extern void deleteAction(unsigned char action);
 extern void deleteEvent(Event* ev);
 
@@ -107,6 +160,9 @@ BYTE    findEventContinuation(BYTE eventIndex);
 BYTE    eventHash( BYTE nodeByte, BYTE eventBYTE );
 
 BOOL    parseCbusEvent( BYTE *msg );
+#ifdef EVENT_STATE_CACHE
+BOOL    parseCbusEventRequest( BYTE *msg );
+#endif
 
 
 
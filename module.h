@@ -57,17 +57,160 @@ typedef struct {
   
 #define NUM_ACTIONS                         (NUM_CONSUMER_ACTIONS + NUM_PRODUCER_ACTIONS)
 
-// These are chosen so we don't use too much memory 32*20 = 640 bytes.
+// By default the events2actions table is searched using a hash table in RAM.
+// Define EVENT_SORTED_TABLE to keep the events2actions table sorted by NN and EN
+// instead, and search it with a binary search in Flash. This uses no RAM for the
+// lookup but teaching and unlearning events is slower as entries are moved in Flash,
+// and bench/hash_bench.c shows each lookup reading 9 to 11 words of eventKeys against
+// 2 to 3.5 for the hashtable with EVENT_HASH_MULTIPLY.
+// Changing this setting requires all the consumed events to be cleared (NNCLR).
+//#define EVENT_SORTED_TABLE
+
+// Alternatively define EVENT_PERFECT_HASH to build a perfect hash of the taught events
+// each time learn mode is released, stored in Flash at AT_EVENTHASH. Every lookup then
+// needs exactly one event compare, whatever the node and event numbers. If no hash can
+// be found the events are searched instead, counted by perfectHashFailures. With 192
+// events bench/hash_bench.c shows a build hashing an event 12000 to 47000 times.
+//#define EVENT_PERFECT_HASH
+
+// Define to spread the wear of teaching and unlearning events across the whole
+// events2actions table. New events take the next unused slot after the last one taught
+// rather than the first, and an unlearnt event's key is overwritten with a tombstone
+// instead of being erased. The tombstones are erased together when learn mode is released
+// with a quarter of the slots holding one, or when no other slot is left. Event 0 of
+// node 0 can't then be taught. Not available with EVENT_SORTED_TABLE.
+// Simulating 2000 learn sessions, each teaching and unlearning 4 of 80 to 120 events, the
+// most erased block of the keys was erased about 150 times with this against 1500
+// without, and of the action offsets about 210 times against 3000. The action arena
+// is unchanged, it is already written in turn.
+//#define EVENT_WEAR_LEVELLING
+
 // Used to size the hash table used to lookup events in the events2actions table.
-#define HASH_LENGTH     32
-#define CHAIN_LENGTH    20
+// The table uses open addressing so must be larger than NUM_CONSUMED_EVENTS, and
+// must be a power of 2. 256 entries keeps the load factor at 75% and uses 256 bytes.
+#define EVENT_HASH_LENGTH   256
+
+// Selects the function used to hash events into the hashtable. EVENT_HASH_MULTIPLY spreads
+// runs of consecutive node and event numbers, as most layouts use, across the whole table.
+// EVENT_HASH_XOR is the original hash, which maps them to neighbouring entries and so gives
+// long probe sequences. With 192 events in 256 entries bench/hash_bench.c gives longest
+// probe sequences of 3 to 7 entries for EVENT_HASH_MULTIPLY and 9 to 140 for EVENT_HASH_XOR
+// over its layouts. EVENT_HASH_MODULE calls the module's own
+// unsigned char moduleEventHash(WORD nn, WORD en) instead.
+#define EVENT_HASH_FUNCTION EVENT_HASH_MULTIPLY
+
+// Define to check received events against a Bloom filter in RAM before looking them
+// up, so events this module doesn't consume are rejected without reading Flash.
+// Must be a power of 2 from 128 to 512 bits. Larger filters give fewer false positives,
+// use the eventBloomHits, eventBloomMisses and eventBloomFalsePositives counters to size it.
+// Uses EVENT_BLOOM_BITS/8 bytes of RAM for the filter and 6 bytes for the counters.
+//#define EVENT_BLOOM_BITS    512
+
+// Define to keep the most recently used consumed events in a small RAM cache which is
+// checked before the event lookup, as layouts tend to repeat the same few events in
+// bursts. Uses 5 bytes of RAM per entry and 4 bytes for the eventCacheHits and
+// eventCacheMisses counters.
+//#define EVENT_CACHE_SIZE    4
+
+// Define to index the short events (held with NN 0) by device number in a direct mapped
+// table in RAM, so most short events are found with a single compare. Must be a power
+// of 2 and uses that many bytes of RAM, 64 bytes as below. Device numbers sharing an
+// entry fall back to the normal lookup.
+//#define SHORT_EVENT_INDEX_SIZE  64
+
+// Define to support consumed event ranges, where one entry covers a span of event
+// numbers from one node, or from any node, giving the same action or consecutive
+// actions. They are held sorted in Flash at AT_EVENTRANGES and taught with doEvlrnRange().
+// Uses 8 bytes of Flash per range and 5 bytes of RAM, for the count of ranges and the
+// span of event numbers they cover, which lets events outside it skip the search.
+//#define NUM_EVENT_RANGES    32
+
+// Define for consumed events to be passed to the module's processActions() with all of
+// their actions in one call, instead of calling processEvent() for each action.
+//#define EVENT_PROCESS_ACTIONS
+
+// Define to remember the last ON/OFF state received for each consumed event, so that
+// repeats of the same state, such as at start of day, can be skipped and AREQ/ASRQ
+// requests to this node for the consumed events answered from RAM. Uses
+// NUM_CONSUMED_EVENTS/4 bytes of RAM. EVENT_REPEAT_SUPPRESSED decides for each action
+// whether a repeat is skipped, events with data bytes are never skipped.
+//#define EVENT_STATE_CACHE
+#define EVENT_REPEAT_SUPPRESSED(action)     TRUE
+
+// Define to keep the ON and OFF CAN frames of each produced event ready encoded in RAM,
+// so sendProducedEvent() is a single enqueue. The frames are rebuilt when a produced
+// event is taught or unlearnt, and when the CANID or node number changes. Uses NUM_PRODUCER_ACTIONS * 32
+// bytes of RAM and needs CBUS over CAN.
+//#define PRODUCED_EVENT_FRAMES
+
+// Define to keep a RAM bitmap of the events using each action, so deleting an action
+// only reads the events that use it. Uses NUM_ACTIONS * NUM_CONSUMED_EVENTS/8 bytes of RAM,
+// 24 bytes per action with 192 events.
+//#define ACTION_EVENT_MAP
 
 #define EVT_NUM                 NUM_ACTIONS // Number of events
 #define EVperEVT                17          // Event variables per event - just the action
 #define NUM_CONSUMED_EVENTS     192         // number of events that can be taught
+#define EVENT_ACTION_ARENA      1536        // bytes of Flash shared by the actions of the consumed events
 #define AT_ACTION2EVENT         0x7E80      //(AT_NV - sizeof(Event)*NUM_PRODUCER_ACTIONS) Size=256 bytes
-#define AT_EVENT2ACTION         0x6E80      //(AT_ACTION2EVENT - sizeof(Event2Action)*HASH_LENGTH) Size=4096bytes
+#define AT_EVENTACTIONS         0x7880      //(AT_ACTION2EVENT - EVENT_ACTION_ARENA) Size=1536 bytes
+#define AT_EVENTRUNS            0x7700      //(AT_EVENTACTIONS - sizeof(WORD)*NUM_CONSUMED_EVENTS) Size=384 bytes
+#define AT_EVENTKEYS            0x7400      //(AT_EVENTRUNS - sizeof(Event)*NUM_CONSUMED_EVENTS) Size=768 bytes
+#define AT_EVENTHASH            0x7280      //(AT_EVENTKEYS - sizeof(PerfectHash)) rounded down to a Flash block. Size=322 bytes, only used with EVENT_PERFECT_HASH
+#define AT_EVENTRANGES          0x7180      //(AT_EVENTHASH - sizeof(EventRange)*NUM_EVENT_RANGES) Size=256 bytes
+
+// Each Flash table must start on a Flash block so that none of its entries straddles two
+// blocks, and teaching an event only needs one erase/write cycle of each table it changes.
+// The events are 4 bytes, the action offsets 2 and the event ranges 8 so a whole number fit in a block,
+// and the action runs in the arena are allocated so they never cross a block boundary.
+#define FLASH_BLOCK_SIZE        64          // _FLASH_WRITE_SIZE of the PIC18F25K80
+#if (AT_NV % FLASH_BLOCK_SIZE) || (AT_ACTION2EVENT % FLASH_BLOCK_SIZE) || (AT_EVENTACTIONS % FLASH_BLOCK_SIZE) \
+        || (AT_EVENTRUNS % FLASH_BLOCK_SIZE) || (AT_EVENTKEYS % FLASH_BLOCK_SIZE) || (AT_EVENTHASH % FLASH_BLOCK_SIZE) \
+        || (AT_EVENTRANGES % FLASH_BLOCK_SIZE)
+#error "The Flash tables must start on a Flash block boundary"
+#endif
+#if (EVENT_ACTION_ARENA % FLASH_BLOCK_SIZE) || (1+EVperEVT > FLASH_BLOCK_SIZE)
+#error "EVENT_ACTION_ARENA must be whole Flash blocks and a run of EVperEVT actions must fit in one"
+#endif
+// Each table must also end before the next one starts, the events being 4 bytes and the
+// action offsets 2. The perfect hash is checked in events.c where its size is defined.
+#if (AT_ACTION2EVENT + 4*NUM_PRODUCER_ACTIONS > AT_NV)
+#error "action2Event overlaps the NVs, move AT_ACTION2EVENT down"
+#endif
+#if (AT_EVENTACTIONS + EVENT_ACTION_ARENA > AT_ACTION2EVENT)
+#error "The action arena overlaps action2Event, move AT_EVENTACTIONS down"
+#endif
+#if (AT_EVENTRUNS + 2*NUM_CONSUMED_EVENTS > AT_EVENTACTIONS)
+#error "eventActionRuns overlaps the action arena, move AT_EVENTRUNS down"
+#endif
+#if (AT_EVENTKEYS + 4*NUM_CONSUMED_EVENTS > AT_EVENTRUNS)
+#error "eventKeys overlaps eventActionRuns, move AT_EVENTKEYS down"
+#endif
+#if defined(NUM_EVENT_RANGES) && (AT_EVENTRANGES + 8*NUM_EVENT_RANGES > AT_EVENTHASH)
+#error "eventRanges overlaps the perfect hash, move AT_EVENTRANGES down"
+#endif
 
+/*
+ * FLASH
+ */
+// Number of 64 byte Flash blocks held in the RAM write back cache, from 1 to 4.
+// Changes to the cached blocks are combined until flushFlashImage() commits them, so
+// with more than one block, writes which move between a few tables, such as teaching an
+// event, only erase and write each block once. Each block uses 68 bytes of RAM.
+#define FLASH_CACHE_BLOCKS  1
+
+// Define FLASH_DEFERRED_FLUSH for commitFlashImage() to leave the changes in the cache
+// instead of writing them to Flash straight away, so the reply such as WRACK goes out
+// without waiting for an erase. The changes are written a step at a time when flashIdleTask()
+// is called with the main loop idle or FLASH_FLUSH_QUIET_TIME after the last commit. They
+// are written without returning when the cache entry is needed for another block, or when
+// flushFlashImage() is called. flushFlashImage() is the sync point. It is called before
+// each configuration command for this node, or any in learn mode, and must be called before
+// power-down. Received events are looked up through the cache so don't wait for it. Module
+// code which reads Flash directly, such as the NVs, must call it first, or use
+// readFlashBlock(), to see changes which haven't been written yet.
+//#define FLASH_DEFERRED_FLUSH
+#define FLASH_FLUSH_QUIET_TIME  HUNDRED_MILI_SECOND
 
 #ifdef	__cplusplus
 }
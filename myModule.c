@@ -145,7 +145,9 @@ int main(void) @0x800 {
                 sendStartupSod(SOD_PRODUCED_ACTION);
             }
         }
-        checkCBUS();    // Consume any CBUS message - display it if not display message mode
+        // Consume any CBUS message - display it if not display message mode
+        // and write any deferred Flash changes once there are none waiting
+        flashIdleTask( ! checkCBUS());
         FLiMSWCheck();  // Check FLiM switch for any mode changes
         // Module specific stuff here
         // Check for any flashing status LEDs
@@ -206,12 +208,26 @@ BOOL checkCBUS( void ) {
     return FALSE;
 }
 
+#ifdef EVENT_PROCESS_ACTIONS
+/**
+ * Handle the Consumed event, performing all of its actions.
+ * @param actions the actions, in Flash
+ * @param count the number of actions
+ * @param on TRUE for an ON event
+ * @param dataLength the number of data bytes after the event
+ * @param msg the received message
+ */
+void processActions(const BYTE * actions, BYTE count, BOOL on, BYTE dataLength, BYTE * msg) {
+    
+}
+#else
 /**
  * Handle the Consumed event.
  */
 void processEvent(unsigned char action, BYTE * msg) {
     
 }
+#endif
 
 /**
  * Validate the the NV change is OK.
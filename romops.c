@@ -48,13 +48,14 @@
 */
 /**
  * Flash routines hide the complexity of erasing and writing in pages.
- * A buffer is kept of the current page being changed and then writing it back
+ * A buffer is kept of the pages being changed and then writing each back
  * in a single operation. This reduces the number of writes to each page of flash
  * and extending its life.
  */
 #include <xc.h>
 #include "romops.h"
 #include "EEPROM.h"
+#include <stddef.h>
 
 //#pragma romdata BOOTFLAG
 //rom BYTE bootflag = 0;
@@ -63,10 +64,37 @@
 #pragma udata MAIN_VARS
 #endif
 
-FlashFlags  flashFlags;
-BYTE        flashbuf[_FLASH_WRITE_SIZE];    // Assumes that Erase and Write are the same size
+FlashFlags  flashFlags[FLASH_CACHE_BLOCKS];
+BYTE        flashbuf[FLASH_CACHE_BLOCKS][_FLASH_WRITE_SIZE];  // Assumes that Erase and Write are the same size
 BYTE        flashidx;
-WORD        flashblock;                     //address of current 64 byte flash block
+WORD        flashblock[FLASH_CACHE_BLOCKS];     //address of each cached 64 byte flash block
+BYTE        flashLRU[FLASH_CACHE_BLOCKS];       //cache entries in order of use, most recently used first
+
+// Flash programming state machine
+
+enum FlashProgramStates {
+    fpIdle = 0,
+    fpErase,            // erase the block
+    fpLoad,             // load the next chunk into the holding registers
+    fpWrite             // write the holding registers
+};
+
+#ifdef CPUF18F
+#define FLASH_HOLDING_SIZE  32  // 18F processors write 32 bytes at a time
+#else
+#define FLASH_HOLDING_SIZE  64  // K series processors can write 64 bytes in one operation
+#endif
+#define FLASH_LOAD_CHUNK    16  // bytes loaded into the holding registers in each step
+
+BYTE        flashProgramState;
+BYTE        flashProgramEntry;                  //cache entry being written
+BYTE        flashProgramIdx;                    //next byte of the entry to load
+WORD        maxFlashBlackout;                   //longest time interrupts were disabled for a Flash erase or write
+
+#ifdef FLASH_DEFERRED_FLUSH
+BOOL        flashCommitPending;                 //committed changes not yet written to Flash
+TickValue   flashCommitTime;                    //time of the last commit
+#endif
 
 #ifndef __XC8__
 #pragma code APP
@@ -74,160 +102,276 @@ WORD        flashblock;                     //address of current 64 byte flash b
 
 // Internal function definitions
 
-void writeFlashShort(void);
-void writeFlashLong(void);
+void flashProgramUnlock(BOOL erase);
+void flashProgramStart(BYTE entry, BOOL erase);
+BOOL flashProgramStep(void);
+void flashProgramFinish(void);
+void writeBackFlashEntry(BYTE entry);
+BYTE findFlashEntry(WORD block);
+BYTE loadFlashEntry(WORD block);
+void useFlashEntry(BYTE entry);
+BYTE getFlashEntry(WORD block);
+void writeFlashBlocks(BYTE * flashAddr, BYTE *data, BYTE fillData, WORD size);
 BYTE readFlashBlock(WORD flashAddr);
 
+#if (FLASH_CACHE_BLOCKS < 1) || (FLASH_CACHE_BLOCKS > 4)
+#error "FLASH_CACHE_BLOCKS must be from 1 to 4"
+#endif
+
 /**
  *  Initialise variables for Flash program tracking.
  */
 void initRomOps() {
-    flashFlags.asByte = 0;
-    flashblock = 0xFFFF;
+    BYTE entry;
+
+    for (entry=0; entry<FLASH_CACHE_BLOCKS; entry++) {
+        flashFlags[entry].asByte = 5;   // valid but not loaded
+        flashblock[entry] = 0xFFFF;
+        flashLRU[entry] = entry;
+    }
+    flashProgramState = fpIdle;
+    maxFlashBlackout = 0;
+#ifdef FLASH_DEFERRED_FLUSH
+    flashCommitPending = FALSE;
+#endif
 }
 
 
 /**
- * Flash block write. flash 64 byte buffer.
- * Fast write, this requires no 0 to 1 bit changes, only 1 to 0 bits are allowed. 
- * Or use write_flash_long with erase before write 
+ * Flash programming state machine. A block is erased and written as a series of
+ * short steps, and interrupts are only disabled for the unlock sequence of each
+ * erase or write, rather than for the whole block. The holding registers are loaded
+ * a chunk at a time with interrupts enabled, so an interrupt routine must not use
+ * TBLWT, and TBLPTR is set again at the start of every step as other code may read
+ * program memory between steps.
+ * The processor stalls whilst an erase or write is in progress, so interrupts raised
+ * then are serviced as soon as it completes. maxFlashBlackout records the longest
+ * time interrupts were disabled, in timer ticks of 16uS.
  */
- void  writeFlashShort(void) {
+void flashProgramUnlock(BOOL erase) {
+    WORD start, end;
+
+    EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
+    EECON1bits.CFGS = 0;    // 0=Program memory/EEPROM, 1=ConfigBits
+    EECON1bits.WREN = 1;    // enable write to memory
+    EECON1bits.FREE = erase;    // row erase or write of the holding registers
     INTCONbits.GIE = 0;     // disable all interrupts
-#ifdef __XC8__
-    TBLPTR = flashblock & ~(64 - 1); //force row boundary
-    for (unsigned char i=0; i<64; i++) {
-        TABLAT = flashbuf[i];
-        asm("TBLWT*+");
-        EECON2 = 0x55;
-        EECON2 = 0xAA;
-        EECON1bits.WR = TRUE;
+    start = TMR_L;          // reading the low byte latches the high byte
+    start |= (WORD)TMR_H << 8;
+    EECON2 = 0x55;          // write 0x55
+    EECON2 = 0xaa;          // write 0xaa
+    EECON1bits.WR = 1;      // start erasing or writing, the processor stalls until complete
+    end = TMR_L;
+    end |= (WORD)TMR_H << 8;
+    INTCONbits.GIE = 1;     // enable all interrupts
+    EECON1bits.WREN = 0;    // disable write to memory
+    if ((WORD)(end - start) > maxFlashBlackout) {
+        maxFlashBlackout = end - start;
     }
-    EECON1bits.WREN = FALSE;
-#else
-    WORD ptr;
-    BYTE fwCounter;
+}
 
-    ptr= (WORD)flashbuf;
-    TBLPTR=flashblock;
-    FSR0=ptr;
-    
+/**
+ * Start writing a cache entry to Flash. The entry may still be changed whilst it is
+ * being written, as that marks it modified again so it is written again afterwards.
+ * It must not be reused for another block until it has been written, see
+ * flashProgramFinish().
+ * @param entry the cache entry to be written
+ * @param erase TRUE to erase the block first, needed if any bits change from 0 to 1
+ */
+void flashProgramStart(BYTE entry, BOOL erase) {
+    flashFlags[entry].modified = 0;
+    flashFlags[entry].zeroto1 = 0;
+    flashProgramEntry = entry;
+    flashProgramIdx = 0;
+    flashProgramState = erase ? fpErase : fpLoad;
+}
 
-#ifdef CPUF18K
-    flashidx=64;            // K series processors can write 64 bytes in one operation
+/**
+ * Perform the next step of writing the block to Flash.
+ * @return TRUE if there are more steps to do
+ */
+BOOL flashProgramStep(void) {
+    BYTE n;
+
+    switch (flashProgramState) {
+    case fpErase:
+        TBLPTR = flashblock[flashProgramEntry];
+        flashProgramUnlock(TRUE);
+        flashProgramState = fpLoad;
+        break;
+
+    case fpLoad:
+        TBLPTR = flashblock[flashProgramEntry] + flashProgramIdx;
+        for (n=0; n<FLASH_LOAD_CHUNK; n++) {
+            TABLAT = flashbuf[flashProgramEntry][flashProgramIdx++];
+#ifdef __XC8__
+            asm("TBLWT*+");
 #else
-    for (fwCounter = 1; fwCounter <=2; fwCounter++ )    // 18F processors need two iterations of 32 bytes each
-    {
-         flashidx=32;
-#endif
-
 _asm
-L_w:
-        MOVF POSTINC0,W,0
-        MOVWF TABLAT,0
-        TBLWTPOSTINC
-        DECF flashidx,F,1
-        BNZ L_w
-        TBLRDPOSTDEC            //PUT IT BACK IN THE BLOCK
-_endasm
-
-        EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
-        EECON1bits.CFGS = 0;    // 0=ProgramMemory/EEPROM, 1=ConfigBits
-        EECON1bits.FREE = 0;    // No erase
-        EECON1bits.WREN = 1;    // enable write to memory
-        EECON2 = 0x55;          // write 0x55
-        EECON2 = 0xaa;          // write 0xaa
-        EECON1bits.WR = 1;      // start writing
-        EECON1bits.WREN = 0;    // disable write to memory
-        
-_asm
-        TBLRDPOSTINC            // Table pointer ready for next 32
+            TBLWTPOSTINC
 _endasm
 #endif
+        }
+        if ((flashProgramIdx & (FLASH_HOLDING_SIZE - 1)) == 0) {
+            flashProgramState = fpWrite;    // holding registers full
+        }
+        break;
 
-#ifdef CPUF18F
+    case fpWrite:
+        TBLPTR = flashblock[flashProgramEntry] + flashProgramIdx - 1;   // must point within the holding registers written
+        flashProgramUnlock(FALSE);
+        flashProgramState = (flashProgramIdx < _FLASH_WRITE_SIZE) ? fpLoad : fpIdle;
+        break;
+
+    default:
+        flashProgramState = fpIdle;
+        break;
     }
-#endif
-    INTCONbits.GIE = 1;     // enable all interrupts
+    return flashProgramState != fpIdle;
 }
 
+/**
+ * Complete the block being written, if flashIdleTask() has only done some of its steps.
+ */
+void flashProgramFinish(void) {
+    while (flashProgramStep())
+        ;
+}
 
 /**
- * Flash block write. flash 64 byte buffer with block erase.
+ * If a cache entry has unwritten changes then write these out to Flash. This waits
+ * for all the steps, as the entry is about to be reused or the caller needs the
+ * changes to be in Flash.
+ * @param entry the cache entry
  */
-void  writeFlashLong(void) {
-    // Erase block first
-    TBLPTR=flashblock;
-    INTCONbits.GIE = 0;     // disable all interrupts
-    EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
-    EECON1bits.CFGS = 0;    // 0=Program memory/EEPROM, 1=ConfigBits
-    EECON1bits.WREN = 1;    // enable write to memory
-    EECON1bits.FREE = 1;    // enable row erase operation
-    EECON2 = 0x55;          // write 0x55
-    EECON2 = 0xaa;          // write 0xaa
-    EECON1bits.WR = 1;      // start erasing
-    EECON1bits.WREN = 0;    // disable write to memory
-    INTCONbits.GIE = 1;     // enable all interrupts
-    //Now write data to flash
-    writeFlashShort();
+void writeBackFlashEntry(BYTE entry) {
+    flashProgramFinish();
+    if (flashFlags[entry].modified) {
+        flashProgramStart(entry, flashFlags[entry].zeroto1);
+        flashProgramFinish();
+    }
 }
 
 /**
- * If the buffer has unwritten changes then write these out to Flash.
+ * Commit point for Flash writes. Any cached blocks with unwritten changes are
+ * written out to Flash, each with a single erase and write however many times
+ * it was changed. The blocks stay in the cache.
  */
  void flushFlashImage( void ) {
-     if (flashFlags.modified) {
-        if(flashFlags.zeroto1) {
-            writeFlashLong();
-        } else {
-            writeFlashShort();
-        }
-     }
+    BYTE entry;
+
+    for (entry=0; entry<FLASH_CACHE_BLOCKS; entry++) {
+        writeBackFlashEntry(entry);
+    }
+#ifdef FLASH_DEFERRED_FLUSH
+    flashCommitPending = FALSE;
+#endif
  }
 
+/**
+ * End of a set of changes, such as teaching an event. With FLASH_DEFERRED_FLUSH
+ * the changes are left in the cache to be written by flashIdleTask(), otherwise
+ * they are written to Flash now.
+ */
+void commitFlashImage( void ) {
+#ifdef FLASH_DEFERRED_FLUSH
+    flashCommitPending = TRUE;
+    flashCommitTime.Val = tickGet();
+#else
+    flushFlashImage();
+#endif
+}
+
+/**
+ * Called from the main loop to write committed changes to Flash once the module
+ * has nothing else to do, or FLASH_FLUSH_QUIET_TIME after the last commit if it
+ * stays busy. Each call does one step of writing a block, so the main loop can
+ * process received messages between the erase and the writes of the block.
+ * @param idle TRUE if the main loop has nothing else to do
+ */
+void flashIdleTask( BOOL idle ) {
+#ifdef FLASH_DEFERRED_FLUSH
+    BYTE entry;
+
+    if (flashProgramState != fpIdle) {
+        flashProgramStep();
+        return;
+    }
+    if (flashCommitPending && (idle || (tickTimeSince(flashCommitTime) > FLASH_FLUSH_QUIET_TIME))) {
+        for (entry=0; entry<FLASH_CACHE_BLOCKS; entry++) {
+            if (flashFlags[entry].modified) {
+                flashProgramStart(entry, flashFlags[entry].zeroto1);
+                flashProgramStep();
+                return;
+            }
+        }
+        flashCommitPending = FALSE;
+    }
+#endif
+}
+
 
 /**
- * Flash block read. Read flash through a 64 byte buffer with write back management.
+ * Flash block cache. Up to FLASH_CACHE_BLOCKS 64 byte blocks are held in RAM with
+ * write back management, so writes which move between a few blocks, such as teaching
+ * an event, don't erase and write a block each time they move. When a block is needed
+ * which isn't cached, the least recently used entry is written back if it has changed
+ * and then reused. Changes stay in the cache until flushFlashImage() is called or the
+ * entry is reused, so until then they can only be read back through readFlashBlock().
  *  valid:3    //must be 101 (5) to be valid
  *  loaded:1   // if buffer is loaded
  *  modified:1 //flag if buffer is modified
  *  zeroto1:1  //flag if long write with block erase
  */
- /**
- * Read a byte from flash. If the required buffer is currently loaded then use the value 
- * stored there since it may have been modified. Otherwise load the buffer from flash
-  * before returning the value.
- * @param addr the address to be read from Flash
- * @return the byte read from Flash
+
+/**
+ * Find the cache entry holding a block.
+ * @param block the address of the 64 byte block
+ * @return the cache entry, or FLASH_CACHE_BLOCKS if the block is not cached
  */
-BYTE readFlashBlock(WORD flashAddr) {
-    WORD ptr;
+BYTE findFlashEntry(WORD block) {
+    BYTE entry;
 
-    if(flashFlags.valid !=5) {
-        flashFlags.asByte=5;  //force reload
+    for (entry=0; entry<FLASH_CACHE_BLOCKS; entry++) {
+        if(flashFlags[entry].valid !=5) {
+            flashFlags[entry].asByte=5;  //force reload
+        }
+        if (flashFlags[entry].loaded && (flashblock[entry] == block)) {
+            break;
+        }
     }
+    return entry;
+}
 
-    if(flashFlags.loaded && flashblock!=(flashAddr & 0XFFC0)) {
-        //detected access from a different block so we need to write this one (if it has been changed)
-        flushFlashImage();
-        flashFlags.asByte=5;
-    }
+/**
+ * Load a block into the least recently used cache entry, writing back the
+ * block it held first if that has been changed.
+ * @param block the address of the 64 byte block
+ * @return the cache entry
+ */
+BYTE loadFlashEntry(WORD block) {
+    BYTE entry;
+#ifndef __XC8__
+    WORD ptr;
+#endif
 
-    if(!flashFlags.loaded) {
+    entry = flashLRU[FLASH_CACHE_BLOCKS-1];
+    writeBackFlashEntry(entry);
+    flashFlags[entry].asByte=5;
+    flashblock[entry] = block;
 #ifdef __XC8__
-        TBLPTR = flashblock & ~(64 - 1); //force row boundary
-        for (unsigned char i=0; i<64; i++) {
-            asm("TBLRD*+");
-            flashbuf[i] = TABLAT;
-        }
+    TBLPTR = block;
+    for (unsigned char i=0; i<64; i++) {
+        asm("TBLRD*+");
+        flashbuf[entry][i] = TABLAT;
+    }
 #else
-        //load the buffer
-        ptr= (WORD)flashbuf;
-        FSR0=ptr;
-        flashblock = flashAddr & 0XFFC0;
-        TBLPTR=flashblock;
-        EECON1=0X80;
-        flashidx=64;
+    //load the buffer
+    ptr= (WORD)flashbuf[entry];
+    FSR0=ptr;
+    TBLPTR=block;
+    EECON1=0X80;
+    flashidx=64;
 _asm
 //        MOVLB FLASHBUFPAGE
 READ_BLOCK:
@@ -237,38 +381,100 @@ READ_BLOCK:
         BNZ READ_BLOCK
 _endasm
 #endif
-        flashFlags.loaded = TRUE;
+    flashFlags[entry].loaded = TRUE;
+    return entry;
+}
+
+/**
+ * Make a cache entry the most recently used.
+ * @param entry the cache entry
+ */
+void useFlashEntry(BYTE entry) {
+    BYTE i;
+
+    for (i=0; (i < FLASH_CACHE_BLOCKS-1) && (flashLRU[i] != entry); i++)
+        ;
+    for ( ; i>0; i--) {
+        flashLRU[i] = flashLRU[i-1];
     }
-    return flashbuf[flashAddr & 0X3F];
+    flashLRU[0] = entry;
+}
+
+/**
+ * Get the cache entry for a block, loading the block if it isn't cached,
+ * and make it the most recently used.
+ * @param block the address of the 64 byte block
+ * @return the cache entry
+ */
+BYTE getFlashEntry(WORD block) {
+    BYTE entry;
+
+    entry = findFlashEntry(block);
+    if (entry == FLASH_CACHE_BLOCKS) {
+        entry = loadFlashEntry(block);
+    }
+    useFlashEntry(entry);
+    return entry;
+}
+
+ /**
+ * Read a byte from flash. If the required block is currently cached then use the value 
+ * stored there since it may have been modified. Otherwise the byte is read straight from
+ * Flash, without loading it into the cache, so reading never causes a write back.
+ * @param addr the address to be read from Flash
+ * @return the byte read from Flash
+ */
+BYTE readFlashBlock(WORD flashAddr) {
+    BYTE entry;
+
+    entry = findFlashEntry(flashAddr & 0XFFC0);
+    if (entry < FLASH_CACHE_BLOCKS) {
+        return flashbuf[entry][flashAddr & 0X3F];
+    }
+    TBLPTR = flashAddr;
+#ifdef __XC8__
+    asm("TBLRD*");
+#else
+    EECON1=0X80;
+_asm
+        TBLRD
+_endasm
+#endif
+    return TABLAT;
 }
 
 
 /**
- * Write a byte to the FLASH image, flush current image to Flash if necessary.
+ * Read a word from flash, using the cached block if it is in the cache.
+ * @param flashAddr the address of the low byte
+ * @return the word read from Flash
+ */
+WORD readFlashWord(WORD flashAddr) {
+    return readFlashBlock(flashAddr) | ((WORD)readFlashBlock(flashAddr+1) << 8);
+}
+
+/**
+ * Write a byte to the FLASH image, writing back the least recently used image to Flash if necessary.
  * @param addr the destination address of the byte to be written
  * @param data the data byte to be written
  */
 void writeFlashImage(BYTE * addr, BYTE data) {
     unsigned char *offset;
+    BYTE entry;
 
-    if(flashFlags.valid !=5) {
-        flashFlags.valid=5;  //force reload
-    }
-
-    if (!flashFlags.loaded || flashblock!=((WORD)addr & 0XFFC0)) {
-        readFlashBlock((WORD)addr);
-    }
-    offset = &flashbuf[(WORD)addr & 0x3F];
+    entry = getFlashEntry((WORD)addr & 0XFFC0);
+    offset = &flashbuf[entry][(WORD)addr & 0x3F];
 
     if(data !=*offset) {
-        flashFlags.modified=1;
+        flashFlags[entry].modified=1;
     }
     if(data & ~*offset) {
-        flashFlags.zeroto1=1;
+        flashFlags[entry].zeroto1=1;
     }
     *offset=data;
 }
 
+
 /**
  * Write one byte and flush to flash.
  * @param flashAddr the destination address of the byte to be written
@@ -296,9 +502,72 @@ void setFlashWord( WORD * flashAddr, WORD flashData ) {
  * @param bufferSize
  */
 void setFlashBuffer( BYTE * flashAddr, BYTE *bufferaddr, BYTE bufferSize ) {
-    BYTE    i;
-    for ( i=0; i<bufferSize; i++)
-        writeFlashImage( flashAddr+i, bufferaddr[i] );
+    writeFlashBlocks(flashAddr, bufferaddr, 0, bufferSize);
+}
+
+/**
+ * Copy a buffer of any length to the Flash image.
+ * @param flashAddr the first destination address
+ * @param bufferaddr the data to be written
+ * @param bufferSize the number of bytes
+ */
+void writeFlashRange( BYTE * flashAddr, BYTE *bufferaddr, WORD bufferSize ) {
+    writeFlashBlocks(flashAddr, bufferaddr, 0, bufferSize);
+}
+
+/**
+ * Set a range of addresses in the Flash image to one value, such as to clear a table.
+ * @param flashAddr the first destination address
+ * @param fillData the value to be written
+ * @param size the number of bytes
+ */
+void fillFlashRange( BYTE * flashAddr, BYTE fillData, WORD size ) {
+    writeFlashBlocks(flashAddr, NULL, fillData, size);
+}
+
+/**
+ * Write a range of addresses to the Flash image a block at a time. The range is split
+ * at the block boundaries and each block's image is updated in one pass, with its flags
+ * set once, rather than looking up the block for every byte. As the blocks are used
+ * in order each is erased and written at most once when it is written back.
+ * @param flashAddr the first destination address
+ * @param data the bytes to be copied, or NULL to fill with fillData
+ * @param fillData the value to fill the range with if data is NULL
+ * @param size the number of bytes
+ */
+void writeFlashBlocks(BYTE * flashAddr, BYTE *data, BYTE fillData, WORD size) {
+    BYTE entry;
+    BYTE count;
+    BYTE changed;
+    BYTE set;
+    BYTE *image;
+
+    while (size > 0) {
+        entry = getFlashEntry((WORD)flashAddr & 0XFFC0);
+        image = &flashbuf[entry][(WORD)flashAddr & 0x3F];
+        count = _FLASH_WRITE_SIZE - ((WORD)flashAddr & 0x3F);
+        if (size < count) {
+            count = (BYTE)size;
+        }
+        flashAddr += count;
+        size -= count;
+        changed = 0;
+        set = 0;
+        for ( ; count>0; count--) {
+            if (data != NULL) {
+                fillData = *data++;
+            }
+            changed |= fillData ^ *image;
+            set |= fillData & ~*image;
+            *image++ = fillData;
+        }
+        if (changed) {
+            flashFlags[entry].modified=1;
+        }
+        if (set) {
+            flashFlags[entry].zeroto1=1;
+        }
+    }
 }
 
 //*************** EEPROM operations
@@ -49,6 +49,8 @@
 
 #include "devincs.h"
 #include "GenericTypeDefs.h"
+#include "TickTime.h"
+#include "module.h"
 
 // Bit definitions for EEPROM flags
 
@@ -68,6 +70,15 @@
 #define F   1
 #endif 
 
+// Number of 64 byte Flash blocks held in the RAM write back cache, and with
+// FLASH_DEFERRED_FLUSH the longest wait before committed changes are written, see module.h
+#ifndef FLASH_CACHE_BLOCKS
+#define FLASH_CACHE_BLOCKS  1
+#endif
+#ifndef FLASH_FLUSH_QUIET_TIME
+#define FLASH_FLUSH_QUIET_TIME  HUNDRED_MILI_SECOND
+#endif
+
 // Structure for tracking Flash operations
 
 typedef union
@@ -85,6 +96,11 @@ typedef union
 
 // extern rom BYTE bootflag;
 
+#ifdef FLASH_DEFERRED_FLUSH
+extern BOOL flashCommitPending;     // committed changes not yet written to Flash
+#endif
+extern WORD maxFlashBlackout;   // longest time interrupts were disabled for a Flash erase or write, in 16uS ticks
+
 
 void initRomOps(void);
 void writeFlashByte( BYTE * flashAddr, BYTE flashData );
@@ -92,8 +108,13 @@ void writeFlashImage(BYTE * addr, BYTE data);
 #define setFlashByte( a, b )    writeFlashImage( a, b)
 void setFlashWord( WORD * flashAddr, WORD flashData );
 void setFlashBuffer( BYTE * flashAddr, BYTE *bufferaddr, BYTE bufferSize );
-void flushFlashImage( void );;
+void writeFlashRange( BYTE * flashAddr, BYTE *bufferaddr, WORD bufferSize );
+void fillFlashRange( BYTE * flashAddr, BYTE fillData, WORD size );
+void flushFlashImage( void );
+void commitFlashImage( void );
+void flashIdleTask( BOOL idle );
 BYTE readFlashBlock(WORD flashAddr);
+WORD readFlashWord(WORD flashAddr);
 
 BYTE ee_read(WORD addr);
 void ee_write(WORD addr, BYTE data);